@@ -1,6 +1,6 @@
 /*  udscs.c Unix Domain Socket Client Server framework. A framework for quickly
-    creating select() based servers capable of handling multiple clients and
-    matching select() based clients using variable size messages.
+    creating epoll() based servers capable of handling multiple clients and
+    matching GLib main loop based clients using variable size messages.
 
     Copyright 2010 Red Hat, Inc.
 
@@ -28,21 +28,50 @@
 #include <stdlib.h>
 #include <syslog.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <glib.h>
 #include <glib-unix.h>
 #include "udscs.h"
+#ifndef UDSCS_NO_SERVER
+#include "vdagentd/event-loop.h"
+#endif
+
+/* Size of the per connection read buffer, all messages which fit in it are
+   parsed and dispatched straight from it, larger messages get their own
+   buffer */
+#define UDSCS_READ_BUF_SIZE (64 * 1024)
+
+/* Payloads up to this size which are not 8 byte aligned in the read buffer
+   get copied to an aligned buffer, larger ones get moved within the read
+   buffer, so that callbacks can cast the data to a struct */
+#define UDSCS_SMALL_MSG_SIZE 256
 
 struct udscs_buf {
     uint8_t *buf;
     size_t pos;
     size_t size;
+};
+
+/* A queued message, the header is stored in the buffer itself, the payload
+   is either a reference to a GBytes, or stored inline after the buffer. */
+struct udscs_write_buf {
+    struct udscs_message_header header;
+    GBytes *bytes;
+    const uint8_t *data;
+    size_t pos; /* Bytes of header + data already written */
+    int fd; /* fd to pass along with the message, or -1 */
 
-    struct udscs_buf *next;
+    struct udscs_write_buf *next;
 };
 
+/* Maximum number of received fds which have not been claimed yet */
+#define UDSCS_MAX_FDS 16
+
 struct udscs_connection {
     int fd;
     const char * const *type_to_string;
@@ -51,16 +80,43 @@ struct udscs_connection {
     void *user_data;
 #ifndef UDSCS_NO_SERVER
     struct ucred peer_cred;
+    struct vdagentd_event_watch *watch;
 #endif
 
-    /* Read stuff, single buffer, separate header and data buffer */
-    int header_read;
+    /* Read stuff, read_buf holds the data read from the socket from
+       read_start till read_end which has not been dispatched yet */
+    uint8_t *read_buf;
+    size_t read_start;
+    size_t read_end;
     struct udscs_message_header header;
+    /* Payload of a large message being received */
     struct udscs_buf data;
-
-    /* Writes are stored in a linked list of buffers, with both the header
-       + data for a single message in 1 buffer. */
-    struct udscs_buf *write_buf;
+    /* Payload of the message being passed to the read callback, until it
+       gets claimed with udscs_steal_data() */
+    uint8_t *read_data;
+    /* Set while the server has stopped reading from the connection, messages
+       already in read_buf are dispatched once reading is resumed */
+    int read_paused;
+    union {
+        uint64_t align;
+        uint8_t buf[UDSCS_SMALL_MSG_SIZE];
+    } small_data;
+    /* Received fds, waiting to be claimed with udscs_steal_fd() */
+    int fds[UDSCS_MAX_FDS];
+    int fds_start;
+    int fds_count;
+
+    /* Writes are stored in a linked list of buffers, one per message,
+       which get written to the socket with writev(). */
+    struct udscs_write_buf *write_buf;
+    struct udscs_write_buf *write_buf_tail;
+    unsigned int write_buf_depth;
+    unsigned int write_buf_max_depth;
+    size_t write_buf_bytes;
+    int write_queue_full;
+    /* Number of write syscalls done and messages completed by them */
+    unsigned long write_calls;
+    unsigned long write_msgs;
 
     /* Callbacks */
     udscs_read_callback read_callback;
@@ -133,9 +189,18 @@ struct udscs_connection *udscs_connect(const char *socketname,
     return conn;
 }
 
+static void udscs_write_buf_free(struct udscs_write_buf *wbuf)
+{
+    if (wbuf->bytes)
+        g_bytes_unref(wbuf->bytes);
+    if (wbuf->fd != -1)
+        close(wbuf->fd);
+    free(wbuf);
+}
+
 void udscs_destroy_connection(struct udscs_connection **connp)
 {
-    struct udscs_buf *wbuf, *next_wbuf;
+    struct udscs_write_buf *wbuf, *next_wbuf;
     struct udscs_connection *conn = *connp;
 
     if (!conn)
@@ -144,16 +209,30 @@ void udscs_destroy_connection(struct udscs_connection **connp)
     if (conn->disconnect_callback)
         conn->disconnect_callback(conn);
 
+    if (conn->debug)
+        syslog(LOG_DEBUG,
+               "%p write queue max depth: %u, %lu messages in %lu writes",
+               conn, conn->write_buf_max_depth, conn->write_msgs,
+               conn->write_calls);
+
     wbuf = conn->write_buf;
     while (wbuf) {
         next_wbuf = wbuf->next;
-        free(wbuf->buf);
-        free(wbuf);
+        udscs_write_buf_free(wbuf);
         wbuf = next_wbuf;
     }
 
     free(conn->data.buf);
     conn->data.buf = NULL;
+    free(conn->read_buf);
+    conn->read_buf = NULL;
+    while (conn->fds_count) {
+        close(udscs_steal_fd(conn));
+    }
+
+#ifndef UDSCS_NO_SERVER
+    vdagentd_event_loop_remove_watch(conn->watch);
+#endif
 
     if (conn->next)
         conn->next->prev = conn->prev;
@@ -180,49 +259,92 @@ void udscs_set_user_data(struct udscs_connection *conn, void *data)
     conn->user_data = data;
 }
 
-void *udscs_get_user_data(struct udscs_connection *conn)
+int udscs_write_queue_full(struct udscs_connection *conn)
 {
-    if (!conn)
-        return NULL;
+    return conn->write_queue_full;
+}
 
-    return conn->user_data;
+void udscs_get_write_queue_stats(struct udscs_connection *conn,
+    unsigned int *depth, size_t *bytes, unsigned int *max_depth)
+{
+    if (depth)
+        *depth = conn->write_buf_depth;
+    if (bytes)
+        *bytes = conn->write_buf_bytes;
+    if (max_depth)
+        *max_depth = conn->write_buf_max_depth;
 }
 
-int udscs_write(struct udscs_connection *conn, uint32_t type, uint32_t arg1,
-    uint32_t arg2, const uint8_t *data, uint32_t size)
+void udscs_get_write_stats(struct udscs_connection *conn,
+    unsigned long *calls, unsigned long *msgs)
 {
-    struct udscs_buf *wbuf, *new_wbuf;
-    struct udscs_message_header header;
+    if (calls)
+        *calls = conn->write_calls;
+    if (msgs)
+        *msgs = conn->write_msgs;
+}
 
-    new_wbuf = malloc(sizeof(*new_wbuf));
-    if (!new_wbuf)
-        return -1;
+int udscs_steal_fd(struct udscs_connection *conn)
+{
+    int fd;
 
-    new_wbuf->pos = 0;
-    new_wbuf->size = sizeof(header) + size;
-    new_wbuf->next = NULL;
-    new_wbuf->buf = malloc(new_wbuf->size);
-    if (!new_wbuf->buf) {
-        free(new_wbuf);
+    if (!conn->fds_count)
         return -1;
+
+    fd = conn->fds[conn->fds_start];
+    conn->fds_start = (conn->fds_start + 1) % UDSCS_MAX_FDS;
+    conn->fds_count--;
+    return fd;
+}
+
+uint8_t *udscs_steal_data(struct udscs_connection *conn)
+{
+    uint8_t *data;
+
+    if (!conn->read_data || !conn->header.size)
+        return NULL;
+
+    if (conn->read_data == conn->data.buf) {
+        /* Large messages are received in a buffer of their own */
+        data = conn->data.buf;
+        memset(&conn->data, 0, sizeof(conn->data)); /* data.buf = NULL */
+    } else {
+        data = malloc(conn->header.size);
+        if (!data) {
+            syslog(LOG_ERR, "out of memory claiming udscs message data");
+            return NULL;
+        }
+        memcpy(data, conn->read_data, conn->header.size);
     }
 
-    header.type = type;
-    header.arg1 = arg1;
-    header.arg2 = arg2;
-    header.size = size;
+    conn->read_data = NULL;
+    return data;
+}
 
-    memcpy(new_wbuf->buf, &header, sizeof(header));
-    memcpy(new_wbuf->buf + sizeof(header), data, size);
+void *udscs_get_user_data(struct udscs_connection *conn)
+{
+    if (!conn)
+        return NULL;
+
+    return conn->user_data;
+}
+
+/* A helper for udscs_write() and udscs_write_bytes() */
+static void udscs_queue_write_buf(struct udscs_connection *conn,
+    struct udscs_write_buf *new_wbuf)
+{
+    struct udscs_message_header *header = &new_wbuf->header;
 
     if (conn->debug) {
-        if (type < conn->no_types)
+        if (header->type < conn->no_types)
             syslog(LOG_DEBUG, "%p sent %s, arg1: %u, arg2: %u, size %u",
-                   conn, conn->type_to_string[type], arg1, arg2, size);
+                   conn, conn->type_to_string[header->type], header->arg1,
+                   header->arg2, header->size);
         else
             syslog(LOG_DEBUG,
                    "%p sent invalid message %u, arg1: %u, arg2: %u, size %u",
-                   conn, type, arg1, arg2, size);
+                   conn, header->type, header->arg1, header->arg2,
+                   header->size);
     }
 
     if (conn->io_channel && conn->write_watch_id == 0)
@@ -231,24 +353,97 @@ int udscs_write(struct udscs_connection *conn, uint32_t type, uint32_t arg1,
                            G_IO_OUT | G_IO_ERR | G_IO_NVAL,
                            udscs_io_channel_cb,
                            conn);
+#ifndef UDSCS_NO_SERVER
+    /* Re-arming EPOLLOUT makes epoll report the socket if it is writable */
+    if (conn->watch && !conn->write_buf)
+        vdagentd_event_watch_set_events(conn->watch,
+                                        EPOLLIN | EPOLLOUT | EPOLLET);
+#endif
 
-    if (!conn->write_buf) {
+    conn->write_buf_depth++;
+    if (conn->write_buf_depth > conn->write_buf_max_depth)
+        conn->write_buf_max_depth = conn->write_buf_depth;
+    conn->write_buf_bytes += sizeof(*header) + header->size;
+    if (conn->write_buf_bytes >= UDSCS_WRITE_QUEUE_HIGH_WATER)
+        conn->write_queue_full = 1;
+
+    if (!conn->write_buf)
         conn->write_buf = new_wbuf;
-        return 0;
+    else
+        conn->write_buf_tail->next = new_wbuf;
+    conn->write_buf_tail = new_wbuf;
+}
+
+int udscs_write(struct udscs_connection *conn, uint32_t type, uint32_t arg1,
+    uint32_t arg2, const uint8_t *data, uint32_t size)
+{
+    return udscs_write_fd(conn, type, arg1, arg2, data, size, -1);
+}
+
+int udscs_write_fd(struct udscs_connection *conn, uint32_t type,
+    uint32_t arg1, uint32_t arg2, const uint8_t *data, uint32_t size, int fd)
+{
+    struct udscs_write_buf *new_wbuf;
+
+    /* Store the payload right after the buffer, so that a message takes only
+       a single allocation */
+    new_wbuf = malloc(sizeof(*new_wbuf) + size);
+    if (!new_wbuf) {
+        if (fd != -1)
+            close(fd);
+        return -1;
     }
 
-    /* maybe we should limit the write_buf stack depth ? */
-    wbuf = conn->write_buf;
-    while (wbuf->next)
-        wbuf = wbuf->next;
+    new_wbuf->header.type = type;
+    new_wbuf->header.arg1 = arg1;
+    new_wbuf->header.arg2 = arg2;
+    new_wbuf->header.size = size;
+    new_wbuf->bytes = NULL;
+    new_wbuf->data = (uint8_t *)(new_wbuf + 1);
+    new_wbuf->pos = 0;
+    new_wbuf->fd = fd;
+    new_wbuf->next = NULL;
+    if (size)
+        memcpy(new_wbuf + 1, data, size);
+
+    udscs_queue_write_buf(conn, new_wbuf);
+    return 0;
+}
+
+int udscs_write_bytes(struct udscs_connection *conn, uint32_t type,
+    uint32_t arg1, uint32_t arg2, GBytes *bytes)
+{
+    struct udscs_write_buf *new_wbuf;
+    gsize size = 0;
+    const uint8_t *data = NULL;
+
+    if (bytes)
+        data = g_bytes_get_data(bytes, &size);
+
+    if (size > G_MAXUINT32)
+        return -1;
+
+    new_wbuf = malloc(sizeof(*new_wbuf));
+    if (!new_wbuf)
+        return -1;
 
-    wbuf->next = new_wbuf;
+    new_wbuf->header.type = type;
+    new_wbuf->header.arg1 = arg1;
+    new_wbuf->header.arg2 = arg2;
+    new_wbuf->header.size = size;
+    new_wbuf->bytes = bytes ? g_bytes_ref(bytes) : NULL;
+    new_wbuf->data = data;
+    new_wbuf->pos = 0;
+    new_wbuf->fd = -1;
+    new_wbuf->next = NULL;
 
+    udscs_queue_write_buf(conn, new_wbuf);
     return 0;
 }
 
 /* A helper for udscs_do_read() */
-static void udscs_read_complete(struct udscs_connection **connp)
+static void udscs_read_complete(struct udscs_connection **connp,
+    uint8_t *data)
 {
     struct udscs_connection *conn = *connp;
 
@@ -266,97 +461,304 @@ static void udscs_read_complete(struct udscs_connection **connp)
     }
 
     if (conn->read_callback) {
-        conn->read_callback(connp, &conn->header, conn->data.buf);
+        conn->read_data = data;
+        conn->read_callback(connp, &conn->header, data);
         if (!*connp) /* Was the connection disconnected by the callback ? */
             return;
+        conn->read_data = NULL;
     }
 
     free(conn->data.buf);
     memset(&conn->data, 0, sizeof(conn->data)); /* data.buf = NULL */
-    conn->header_read = 0;
 }
 
-static void udscs_do_read(struct udscs_connection **connp)
+/* A helper for udscs_do_read(), dispatch all complete messages in the read
+   buffer, and start receiving a large message if its header is found.
+   Return value: 1 on success, 0 if the connection has been destroyed. */
+static int udscs_parse_read_buf(struct udscs_connection **connp)
+{
+    size_t avail, size;
+    uint8_t *data;
+    struct udscs_connection *conn = *connp;
+    const size_t header_size = sizeof(conn->header);
+
+    while (conn->read_end - conn->read_start >= header_size) {
+        if (conn->read_paused)
+            return 1;
+
+        memcpy(&conn->header, conn->read_buf + conn->read_start, header_size);
+        avail = conn->read_end - conn->read_start - header_size;
+        size = conn->header.size;
+
+        if (size > UDSCS_READ_BUF_SIZE - header_size) {
+            /* Too large for the read buffer, read the rest of the payload
+               directly into its own buffer */
+            conn->data.size = size;
+            conn->data.buf = malloc(size);
+            if (!conn->data.buf) {
+                syslog(LOG_ERR, "out of memory, disconnecting %p", conn);
+                udscs_destroy_connection(connp);
+                return 0;
+            }
+            memcpy(conn->data.buf,
+                   conn->read_buf + conn->read_start + header_size, avail);
+            conn->data.pos = avail;
+            conn->read_start = 0;
+            conn->read_end = 0;
+            return 1;
+        }
+
+        if (size > avail) /* Wait for the rest of the message */
+            break;
+
+        data = conn->read_buf + conn->read_start + header_size;
+        if (size == 0) {
+            data = NULL;
+        } else if ((uintptr_t)data % sizeof(uint64_t)) {
+            if (size <= UDSCS_SMALL_MSG_SIZE) {
+                memcpy(conn->small_data.buf, data, size);
+                data = conn->small_data.buf;
+            } else {
+                memmove(conn->read_buf, conn->read_buf + conn->read_start,
+                        conn->read_end - conn->read_start);
+                conn->read_end -= conn->read_start;
+                conn->read_start = 0;
+                data = conn->read_buf + header_size;
+            }
+        }
+        conn->read_start += header_size + size;
+
+        udscs_read_complete(connp, data);
+        if (!*connp)
+            return 0;
+    }
+
+    if (conn->read_start == conn->read_end) {
+        conn->read_start = 0;
+        conn->read_end = 0;
+    }
+
+    return 1;
+}
+
+/* A helper for udscs_do_read(), like read() but also receives any fds
+   passed along with the data */
+static ssize_t udscs_recv(struct udscs_connection *conn, uint8_t *buf,
+    size_t size)
+{
+    ssize_t n;
+    int i, nfds, fd;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *hdr;
+    union {
+        struct cmsghdr hdr;
+        uint8_t buf[CMSG_SPACE(sizeof(int) * UDSCS_MAX_FDS)];
+    } cmsg;
+
+    iov.iov_base = buf;
+    iov.iov_len = size;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg.buf;
+    msg.msg_controllen = sizeof(cmsg.buf);
+
+    n = recvmsg(conn->fd, &msg, MSG_CMSG_CLOEXEC);
+    if (n < 0 || msg.msg_controllen == 0)
+        return n;
+
+    if (msg.msg_flags & MSG_CTRUNC)
+        syslog(LOG_ERR, "%p too many fds received, some got dropped", conn);
+
+    for (hdr = CMSG_FIRSTHDR(&msg); hdr; hdr = CMSG_NXTHDR(&msg, hdr)) {
+        if (hdr->cmsg_level != SOL_SOCKET || hdr->cmsg_type != SCM_RIGHTS)
+            continue;
+        nfds = (hdr->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (i = 0; i < nfds; i++) {
+            memcpy(&fd, CMSG_DATA(hdr) + i * sizeof(int), sizeof(int));
+            if (conn->fds_count == UDSCS_MAX_FDS) {
+                syslog(LOG_ERR, "%p too many unclaimed fds, dropping", conn);
+                close(fd);
+                continue;
+            }
+            conn->fds[(conn->fds_start + conn->fds_count) % UDSCS_MAX_FDS] =
+                fd;
+            conn->fds_count++;
+        }
+    }
+
+    return n;
+}
+
+/* Return value: 1 if data was read and more may be available,
+ * 0 if the socket would block or the connection has been destroyed. */
+static int udscs_do_read(struct udscs_connection **connp)
 {
     ssize_t n;
-    size_t to_read;
-    uint8_t *dest;
     struct udscs_connection *conn = *connp;
 
-    if (conn->header_read < sizeof(conn->header)) {
-        to_read = sizeof(conn->header) - conn->header_read;
-        dest = (uint8_t *)&conn->header + conn->header_read;
-    } else {
-        to_read = conn->data.size - conn->data.pos;
-        dest = conn->data.buf + conn->data.pos;
+    if (!conn->data.buf) {
+        /* First dispatch any messages left over from when reading got
+           paused */
+        if (!udscs_parse_read_buf(connp))
+            return 0;
+        if (conn->read_paused)
+            return 0;
     }
 
-    n = read(conn->fd, dest, to_read);
+    if (conn->data.buf) {
+        n = udscs_recv(conn, conn->data.buf + conn->data.pos,
+                       conn->data.size - conn->data.pos);
+    } else {
+        if (!conn->read_buf) {
+            conn->read_buf = malloc(UDSCS_READ_BUF_SIZE);
+            if (!conn->read_buf) {
+                syslog(LOG_ERR, "out of memory, disconnecting %p", conn);
+                udscs_destroy_connection(connp);
+                return 0;
+            }
+        }
+        /* Move a partially received message to the start of the buffer */
+        if (conn->read_start) {
+            memmove(conn->read_buf, conn->read_buf + conn->read_start,
+                    conn->read_end - conn->read_start);
+            conn->read_end -= conn->read_start;
+            conn->read_start = 0;
+        }
+        n = udscs_recv(conn, conn->read_buf + conn->read_end,
+                       UDSCS_READ_BUF_SIZE - conn->read_end);
+    }
     if (n < 0) {
         if (errno == EINTR)
-            return;
+            return 1;
+        if (errno == EAGAIN)
+            return 0;
         syslog(LOG_ERR, "reading unix domain socket: %m, disconnecting %p",
                conn);
     }
     if (n <= 0) {
         udscs_destroy_connection(connp);
-        return;
+        return 0;
     }
 
-    if (conn->header_read < sizeof(conn->header)) {
-        conn->header_read += n;
-        if (conn->header_read == sizeof(conn->header)) {
-            if (conn->header.size == 0) {
-                udscs_read_complete(connp);
-                return;
-            }
-            conn->data.pos = 0;
-            conn->data.size = conn->header.size;
-            conn->data.buf = malloc(conn->data.size);
-            if (!conn->data.buf) {
-                syslog(LOG_ERR, "out of memory, disconnecting %p", conn);
-                udscs_destroy_connection(connp);
-                return;
-            }
-        }
-    } else {
+    if (conn->data.buf) {
         conn->data.pos += n;
         if (conn->data.pos == conn->data.size)
-            udscs_read_complete(connp);
+            udscs_read_complete(connp, conn->data.buf);
+        return *connp != NULL;
     }
+
+    conn->read_end += n;
+    return udscs_parse_read_buf(connp);
 }
 
-static void udscs_do_write(struct udscs_connection **connp)
+/* Return value: 1 if data was written and more is queued,
+ * 0 if the socket would block, the write queue is empty or the connection
+ * has been destroyed. */
+static int udscs_do_write(struct udscs_connection **connp)
 {
     ssize_t n;
-    size_t to_write;
+    size_t len, data_pos;
+    struct iovec iov[IOV_MAX];
+    int iovcnt = 0, msgs = 0, fd = -1;
+    struct msghdr msg;
+    union {
+        struct cmsghdr hdr;
+        uint8_t buf[CMSG_SPACE(sizeof(int))];
+    } cmsg;
+    const size_t header_size = sizeof(struct udscs_message_header);
     struct udscs_connection *conn = *connp;
 
-    struct udscs_buf* wbuf = conn->write_buf;
+    struct udscs_write_buf* wbuf = conn->write_buf;
     if (!wbuf) {
         syslog(LOG_ERR,
                "%p do_write called on a connection without a write buf ?!",
                conn);
-        return;
+        return 0;
+    }
+
+    /* Send the headers and the payloads of as many queued messages as
+       possible with a single writev(), directly from where they are stored,
+       without first assembling them into a single buffer */
+    for (; wbuf && iovcnt + 2 <= IOV_MAX; wbuf = wbuf->next) {
+        /* Pass at most one fd per call, along with the first byte of its
+           message, so that it is received before the message is parsed */
+        if (wbuf->fd != -1) {
+            if (iovcnt)
+                break;
+            fd = wbuf->fd;
+        }
+        if (wbuf->pos < header_size) {
+            iov[iovcnt].iov_base = (uint8_t *)&wbuf->header + wbuf->pos;
+            iov[iovcnt].iov_len = header_size - wbuf->pos;
+            iovcnt++;
+        }
+        data_pos = wbuf->pos > header_size ? wbuf->pos - header_size : 0;
+        if (data_pos < wbuf->header.size) {
+            iov[iovcnt].iov_base = (uint8_t *)wbuf->data + data_pos;
+            iov[iovcnt].iov_len = wbuf->header.size - data_pos;
+            iovcnt++;
+        }
     }
 
-    to_write = wbuf->size - wbuf->pos;
-    n = write(conn->fd, wbuf->buf + wbuf->pos, to_write);
+    if (fd == -1) {
+        n = writev(conn->fd, iov, iovcnt);
+    } else {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        msg.msg_control = cmsg.buf;
+        msg.msg_controllen = sizeof(cmsg.buf);
+        cmsg.hdr.cmsg_level = SOL_SOCKET;
+        cmsg.hdr.cmsg_type = SCM_RIGHTS;
+        cmsg.hdr.cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(&cmsg.hdr), &fd, sizeof(int));
+        n = sendmsg(conn->fd, &msg, 0);
+    }
     if (n < 0) {
         if (errno == EINTR)
-            return;
+            return 1;
+        if (errno == EAGAIN)
+            return 0;
         syslog(LOG_ERR, "writing to unix domain socket: %m, disconnecting %p",
                conn);
         udscs_destroy_connection(connp);
-        return;
+        return 0;
+    }
+    if (fd != -1 && n > 0) {
+        /* The receiver now has its own copy of the fd */
+        close(fd);
+        conn->write_buf->fd = -1;
     }
 
-    wbuf->pos += n;
-    if (wbuf->pos == wbuf->size) {
+    /* Free all completely written messages */
+    while ((wbuf = conn->write_buf) && n > 0) {
+        len = header_size + wbuf->header.size - wbuf->pos;
+        if ((size_t)n < len) {
+            wbuf->pos += n;
+            break;
+        }
+        n -= len;
+
         conn->write_buf = wbuf->next;
-        free(wbuf->buf);
-        free(wbuf);
+        if (!conn->write_buf)
+            conn->write_buf_tail = NULL;
+        conn->write_buf_depth--;
+        conn->write_buf_bytes -= header_size + wbuf->header.size;
+        if (conn->write_buf_bytes <= UDSCS_WRITE_QUEUE_HIGH_WATER / 2)
+            conn->write_queue_full = 0;
+        udscs_write_buf_free(wbuf);
+        msgs++;
     }
+
+    conn->write_calls++;
+    conn->write_msgs += msgs;
+    if (conn->debug && msgs > 1)
+        syslog(LOG_DEBUG, "%p flushed %d messages with a single write", conn,
+               msgs);
+
+    return conn->write_buf != NULL;
 }
 
 static gboolean udscs_io_channel_cb(GIOChannel *source,
@@ -385,6 +787,40 @@ static gboolean udscs_io_channel_cb(GIOChannel *source,
     return G_SOURCE_REMOVE;
 }
 
+void udscs_set_read_paused(struct udscs_connection **connp, int paused)
+{
+    struct udscs_connection *conn = *connp;
+
+    if (conn->read_paused == paused)
+        return;
+    conn->read_paused = paused;
+
+    if (conn->io_channel) {
+        if (paused) {
+            g_source_remove(conn->read_watch_id);
+            conn->read_watch_id = 0;
+            return;
+        }
+        conn->read_watch_id =
+            g_io_add_watch(conn->io_channel,
+                           G_IO_IN | G_IO_ERR | G_IO_NVAL,
+                           udscs_io_channel_cb,
+                           conn);
+        /* Dispatch the messages received before reading got paused */
+        if (!conn->data.buf)
+            udscs_parse_read_buf(connp);
+        return;
+    }
+
+#ifndef UDSCS_NO_SERVER
+    /* The socket is edge-triggered, dispatch what has been received in the
+       mean time */
+    if (!paused)
+        while (*connp && !(*connp)->read_paused && udscs_do_read(connp))
+            ;
+#endif
+}
+
 
 #ifndef UDSCS_NO_SERVER
 
@@ -399,6 +835,9 @@ struct udscs_server {
     udscs_connect_callback connect_callback;
     udscs_read_callback read_callback;
     udscs_disconnect_callback disconnect_callback;
+
+    struct vdagentd_event_loop *event_loop;
+    struct vdagentd_event_watch *watch;
 };
 
 struct udscs_server *udscs_create_server_for_fd(int fd,
@@ -477,6 +916,7 @@ void udscs_destroy_server(struct udscs_server *server)
         udscs_destroy_connection(&conn);
         conn = next_conn;
     }
+    vdagentd_event_loop_remove_watch(server->watch);
     close(server->fd);
     free(server);
 }
@@ -486,25 +926,51 @@ struct ucred udscs_get_peer_cred(struct udscs_connection *conn)
     return conn->peer_cred;
 }
 
-static void udscs_server_accept(struct udscs_server *server) {
+static void udscs_connection_event(void *opaque, uint32_t events)
+{
+    struct udscs_connection *conn = opaque;
+
+    /* The socket is edge-triggered, so drain it until it would block, or
+       until reading gets paused */
+    if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+        while (!conn->read_paused && udscs_do_read(&conn))
+            ;
+        if (!conn)
+            return;
+    }
+
+    if ((events & EPOLLOUT) && conn->write_buf) {
+        while (udscs_do_write(&conn))
+            ;
+        /* Stop watching for EPOLLOUT once everything has been sent */
+        if (conn && !conn->write_buf)
+            vdagentd_event_watch_set_events(conn->watch, EPOLLIN | EPOLLET);
+    }
+}
+
+/* Return value: 1 if a client was accepted (or the accept was interrupted),
+ * 0 if there are no more pending clients. */
+static int udscs_server_accept(struct udscs_server *server) {
     struct udscs_connection *new_conn, *conn;
     struct sockaddr_un address;
     socklen_t length = sizeof(address);
     int r, fd;
 
-    fd = accept(server->fd, (struct sockaddr *)&address, &length);
+    fd = accept4(server->fd, (struct sockaddr *)&address, &length,
+                 SOCK_NONBLOCK);
     if (fd == -1) {
         if (errno == EINTR)
-            return;
-        syslog(LOG_ERR, "accept: %m");
-        return;
+            return 1;
+        if (errno != EAGAIN)
+            syslog(LOG_ERR, "accept: %m");
+        return 0;
     }
 
     new_conn = calloc(1, sizeof(*conn));
     if (!new_conn) {
         syslog(LOG_ERR, "out of memory, disconnecting new client");
         close(fd);
-        return;
+        return 1;
     }
 
     new_conn->fd = fd;
@@ -520,7 +986,18 @@ static void udscs_server_accept(struct udscs_server *server) {
         syslog(LOG_ERR, "Could not get peercred, disconnecting new client");
         close(fd);
         free(new_conn);
-        return;
+        return 1;
+    }
+
+    new_conn->watch = vdagentd_event_loop_add_watch(server->event_loop, fd,
+                                                    EPOLLIN | EPOLLET,
+                                                    udscs_connection_event,
+                                                    new_conn);
+    if (!new_conn->watch) {
+        syslog(LOG_ERR, "Could not watch new client, disconnecting it");
+        close(fd);
+        free(new_conn);
+        return 1;
     }
 
     conn = &server->connections_head;
@@ -536,59 +1013,37 @@ static void udscs_server_accept(struct udscs_server *server) {
 
     if (server->connect_callback)
         server->connect_callback(new_conn);
+
+    return 1;
 }
 
-int udscs_server_fill_fds(struct udscs_server *server, fd_set *readfds,
-        fd_set *writefds)
+static void udscs_server_event(void *opaque, uint32_t events)
 {
-    struct udscs_connection *conn;
-    int nfds;
-
-    if (!server)
-        return -1;
+    struct udscs_server *server = opaque;
 
-    nfds = server->fd + 1;
-    FD_SET(server->fd, readfds);
-
-    conn = server->connections_head.next;
-    while (conn) {
-        FD_SET(conn->fd, readfds);
-        if (conn->write_buf)
-            FD_SET(conn->fd, writefds);
-
-        if (conn->fd >= nfds)
-            nfds = conn->fd + 1;
-
-        conn = conn->next;
-    }
-
-    return nfds;
+    while (udscs_server_accept(server))
+        ;
 }
 
-void udscs_server_handle_fds(struct udscs_server *server, fd_set *readfds,
-        fd_set *writefds)
+int udscs_server_attach_event_loop(struct udscs_server *server,
+    struct vdagentd_event_loop *loop)
 {
-    struct udscs_connection *conn, *next_conn;
-
-    if (!server)
-        return;
-
-    if (FD_ISSET(server->fd, readfds))
-        udscs_server_accept(server);
+    int flags;
 
-    conn = server->connections_head.next;
-    while (conn) {
-        /* conn may be destroyed by udscs_do_read() or udscs_do_write()
-         * (when disconnected), so get the next connection first. */
-        next_conn = conn->next;
+    flags = fcntl(server->fd, F_GETFL);
+    if (flags == -1 || fcntl(server->fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        syslog(LOG_ERR, "making server socket non-blocking: %m");
+        return -1;
+    }
 
-        if (FD_ISSET(conn->fd, readfds))
-            udscs_do_read(&conn);
-        if (conn && FD_ISSET(conn->fd, writefds))
-            udscs_do_write(&conn);
+    server->event_loop = loop;
+    server->watch = vdagentd_event_loop_add_watch(loop, server->fd,
+                                                  EPOLLIN | EPOLLET,
+                                                  udscs_server_event, server);
+    if (!server->watch)
+        return -1;
 
-        conn = next_conn;
-    }
+    return 0;
 }
 
 int udscs_server_write_all(struct udscs_server *server,
@@ -596,15 +1051,22 @@ int udscs_server_write_all(struct udscs_server *server,
         const uint8_t *data, uint32_t size)
 {
     struct udscs_connection *conn;
+    GBytes *bytes;
+    int r = 0;
 
+    /* Share a single copy of the payload between all connections */
+    bytes = g_bytes_new(data, size);
     conn = server->connections_head.next;
     while (conn) {
-        if (udscs_write(conn, type, arg1, arg2, data, size))
-            return -1;
+        if (udscs_write_bytes(conn, type, arg1, arg2, bytes)) {
+            r = -1;
+            break;
+        }
         conn = conn->next;
     }
+    g_bytes_unref(bytes);
 
-    return 0;
+    return r;
 }
 
 int udscs_server_for_all_clients(struct udscs_server *server,
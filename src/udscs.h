@@ -24,8 +24,8 @@
 
 #include <stdio.h>
 #include <stdint.h>
-#include <sys/select.h>
 #include <sys/socket.h>
+#include <glib.h>
 
 
 /* ---------- Generic bits and client-side API ---------- */
@@ -40,7 +40,8 @@ struct udscs_message_header {
 
 /* Callbacks with this type will be called when a complete message has been
  * received. The callback does not own the data buffer and should not free it.
- * The data buffer will be freed shortly after the read callback returns.
+ * The data buffer will be freed shortly after the read callback returns,
+ * unless the callback takes it over with udscs_steal_data().
  * The callback may call udscs_destroy_connection, in which case *connp must be
  * made NULL (which udscs_destroy_connection takes care of).
  */
@@ -79,11 +80,88 @@ struct udscs_connection *udscs_connect(const char *socketname,
 void udscs_destroy_connection(struct udscs_connection **connp);
 
 /* Queue a message for delivery to the client connected through conn.
+ * The payload is copied, use udscs_write_bytes() to pass on large payloads.
  * Return value: 0 on success -1 on error (only happens when malloc fails).
  */
 int udscs_write(struct udscs_connection *conn, uint32_t type, uint32_t arg1,
         uint32_t arg2, const uint8_t *data, uint32_t size);
 
+/* Like udscs_write, but the payload is not copied, instead a reference to
+ * bytes is taken and dropped once the message has been sent. Use
+ * g_bytes_new_take() or g_bytes_new_with_free_func() to hand an existing
+ * buffer over to the connection. bytes may be NULL for an empty payload.
+ *
+ * Return value: 0 on success -1 on error.
+ */
+int udscs_write_bytes(struct udscs_connection *conn, uint32_t type,
+        uint32_t arg1, uint32_t arg2, GBytes *bytes);
+
+/* Like udscs_write, but also pass the file descriptor fd to the other end
+ * of the connection, where it can be claimed with udscs_steal_fd() from the
+ * read callback for the message. This takes ownership of fd, it gets closed
+ * once it has been sent, or when sending it fails.
+ *
+ * Return value: 0 on success -1 on error (only happens when malloc fails).
+ */
+int udscs_write_fd(struct udscs_connection *conn, uint32_t type,
+        uint32_t arg1, uint32_t arg2, const uint8_t *data, uint32_t size,
+        int fd);
+
+/* Claim the oldest file descriptor received on the connection, fds are
+ * always received before (or together with) the message they were sent
+ * with. Fds which do not get claimed are closed when the connection is
+ * destroyed.
+ *
+ * Return value: the fd, which is now owned by the caller, or -1 if no fds
+ * have been received.
+ */
+int udscs_steal_fd(struct udscs_connection *conn);
+
+/* Take ownership of the data of the message currently being passed to the
+ * read callback, this may only be called from the read callback. The data
+ * pointer passed to the callback stays valid until the callback returns.
+ * Large messages are received in a buffer of their own, which is handed
+ * over as is, the data of smaller messages gets copied.
+ *
+ * Return value: the data, to be freed with free(), or NULL if the message
+ * has no data, it has already been claimed or when out of memory.
+ */
+uint8_t *udscs_steal_data(struct udscs_connection *conn);
+
+/* Once more than this many bytes are queued for writing
+ * udscs_write_queue_full() returns true, until the queue has drained to
+ * half of it.
+ */
+#define UDSCS_WRITE_QUEUE_HIGH_WATER (4 * 1024 * 1024)
+
+/* Return value: true if the producer should stop queueing (bulk) messages,
+ * this is advisory, writes are never refused because of it.
+ */
+int udscs_write_queue_full(struct udscs_connection *conn);
+
+/* Get the number of messages and bytes currently queued for writing, and the
+ * highest number of queued messages seen on this connection.
+ * Any of the pointers may be NULL.
+ */
+void udscs_get_write_queue_stats(struct udscs_connection *conn,
+    unsigned int *depth, size_t *bytes, unsigned int *max_depth);
+
+/* Get the number of write syscalls done on this connection, and the number
+ * of messages they have completed. Any of the pointers may be NULL.
+ */
+void udscs_get_write_stats(struct udscs_connection *conn,
+    unsigned long *calls, unsigned long *msgs);
+
+/* Stop / resume reading from the connection, this can be used to apply
+ * backpressure to the other end when the messages it sends cannot be
+ * handled fast enough. Pausing may be done from the read callback, messages
+ * which have already been received get dispatched once reading is resumed.
+ * Resuming dispatches them right away, so it must not be done from a read
+ * callback. The connection may get disconnected by this, in which case
+ * *connp is made NULL.
+ */
+void udscs_set_read_paused(struct udscs_connection **connp, int paused);
+
 /* Associates the specified user data with the connection. */
 void udscs_set_user_data(struct udscs_connection *conn, void *data);
 
@@ -158,18 +236,14 @@ typedef int (*udscs_for_all_clients_callback)(struct udscs_connection **connp,
 int udscs_server_for_all_clients(struct udscs_server *server,
     udscs_for_all_clients_callback func, void *priv);
 
-/* Given a udscs server, fill the fd_sets pointed to by readfds and
- * writefds for select() usage.
- * Return value: value of the highest fd + 1 or -1 if server is NULL
- */
-int udscs_server_fill_fds(struct udscs_server *server, fd_set *readfds,
-    fd_set *writefds);
+struct vdagentd_event_loop;
 
-/* Handle any events flagged by select for the given udscs server.
- * Does nothing if server is NULL.
+/* Register the server with the given event loop. Afterwards new clients get
+ * accepted, and all connections are serviced, from the event loop.
+ * Return value: 0 on success, -1 on error
  */
-void udscs_server_handle_fds(struct udscs_server *server, fd_set *readfds,
-    fd_set *writefds);
+int udscs_server_attach_event_loop(struct udscs_server *server,
+    struct vdagentd_event_loop *loop);
 
 /* Returns the peer's user credentials. */
 struct ucred udscs_get_peer_cred(struct udscs_connection *conn);
@@ -36,71 +36,324 @@
 #include <sys/types.h>
 #include <spice/vd_agent.h>
 #include <glib.h>
+#include <glib-unix.h>
 
 #include "vdagentd-proto.h"
 #include "file-xfers.h"
 
 struct vdagent_file_xfers {
     GHashTable *xfers;
+    /* Names of the files in the directories we save files to, and the next
+       " (n)" copy number to try for a file path, cached while a batch of
+       file-xfers is in progress */
+    GHashTable *dir_names;
+    GHashTable *copy_numbers;
+    /* Worker threads doing the actual writing to disk, so that a slow disk
+       does not block the main loop */
+    GThreadPool *writers;
+    /* Number of file-xfers with a full write queue, reading from vdagentd
+       is paused while this is not 0 */
+    unsigned int throttled_tasks;
+    guint resume_read_id;
     struct udscs_connection *vdagentd;
     char *save_dir;
+    /* Directory holding the journals of resumable file-xfers */
+    char *journal_dir;
     int open_save_dir;
+    size_t block_size;
+    int direct_io;
+    int checksum;
+    int journal;
     int debug;
+    /* Periodically logs the statistics of active file-xfers, when debugging */
+    guint stats_timeout;
+    /* Free space in save_dir as of free_space_time, and the space reserved
+       for file-xfers since then */
+    uint64_t free_space;
+    gint64 free_space_time;
+    uint64_t reserved_space;
 };
 
+/* Default size of the blocks in which file data gets written */
+#define FILE_XFER_DEFAULT_BLOCK_SIZE (256 * 1024)
+/* O_DIRECT requires the buffer, file offset and size of writes to be
+   aligned, 4096 covers the logical block size of all common disks */
+#define FILE_XFER_DIRECT_IO_ALIGN 4096
+/* When enabled, O_DIRECT is only used for files of at least this size */
+#define FILE_XFER_DIRECT_IO_MIN_SIZE (64 * 1024 * 1024)
+/* Amount of written data after which we start its writeback and drop it
+   from the page cache, so that large files do not evict everything else */
+#define FILE_XFER_DROP_CACHE_SIZE (8 * 1024 * 1024)
+/* When journaling is enabled, file-xfers of at least this size are journaled
+   so that they can be resumed after the client disconnects. The journal
+   holds the SHA-256 of every chunk of the file written to disk, and gets
+   updated every interval. */
+#define FILE_XFER_JOURNAL_MIN_SIZE (64 * 1024 * 1024)
+#define FILE_XFER_JOURNAL_CHUNK_SIZE (4 * 1024 * 1024)
+#define FILE_XFER_JOURNAL_INTERVAL (64 * 1024 * 1024)
+#define FILE_XFER_DIGEST_SIZE 32
+/* Maximum age in microseconds of the free space figure */
+#define FILE_XFER_FREE_SPACE_MAX_AGE (5 * G_USEC_PER_SEC)
+/* Number of threads writing file data to disk, shared by all file-xfers */
+#define FILE_XFER_WRITER_THREADS 2
+/* Maximum amount of data received through FILE_XFER_DATA messages which may
+   be waiting to be written to disk, per file-xfer. Once it is reached we stop
+   reading from vdagentd, until half of it has been written. */
+#define FILE_XFER_WRITE_QUEUE_SIZE (4 * 1024 * 1024)
+/* Amount of data a writer thread writes for a task before giving the other
+   file-xfers a turn, so that concurrent file-xfers progress evenly */
+#define FILE_XFER_WRITE_QUANTUM (1024 * 1024)
+/* Interval in seconds at which the statistics get logged when debugging */
+#define FILE_XFER_STATS_INTERVAL 10
+/* Files are written under their name with this suffix, and only get their
+   final name once complete */
+#define FILE_XFER_PART_SUFFIX ".part"
+
 typedef struct AgentFileXferTask {
     uint32_t                       id;
     int                            file_fd;
+    /* Pipe through which vdagentd passes the file data, or -1 */
+    int                            data_fd;
+    guint                          data_watch;
+    /* Set when the file system does not support splice() */
+    int                            no_splice;
+    /* Set when the file has been opened with O_DIRECT */
+    int                            direct_io;
+    /* Aligned buffer gathering the data for O_DIRECT writes */
+    uint8_t                        *block;
+    size_t                         block_size;
+    size_t                         block_fill;
+    /* Position up to which the page cache has been dropped */
+    uint64_t                       drop_cache_pos;
+    /* Buffer the pipe is read into */
+    uint8_t                        *read_buf;
+    /* SHA-256 of all the data of the file, reported to the client along
+       with the success status */
+    GChecksum                      *checksum;
+    /* Journal of the file-xfer, NULL if it is not resumable */
+    char                           *journal_path;
+    GChecksum                      *chunk_checksum;
+    GByteArray                     *chunk_digests;
+    /* The data up to journal_pos is recorded in the journal */
+    uint64_t                       journal_pos;
+    /* When resuming, the data up to resume_pos is compared with the journal
+       and only written to disk if it differs from what is already there */
+    uint64_t                       resume_pos;
+    uint8_t                        *resume_buf;
+    unsigned int                   resume_mismatches;
+    /* Keep the partial file and its journal when the task gets removed */
+    int                            keep_partial;
+    /* Set when the file could not be allocated up front */
+    int                            sparse;
+    /* Set while the write queue is full */
+    int                            throttled;
+    struct vdagent_file_xfers      *xfers;
+    /* Everything below lock is shared with the writer threads */
+    GMutex                         lock;
+    GCond                          cond;
+    /* Set while the task is queued on, or handled by, a writer thread */
+    int                            writing;
+    int                            cancelled;
+    /* GBytes received through FILE_XFER_DATA waiting to be written */
+    GQueue                         write_queue;
+    size_t                         write_queue_size;
+    /* Bytes written, not yet accounted for by the main loop */
+    uint64_t                       written;
+    int                            write_errno;
+    int                            data_eof;
+    guint                          written_id;
+    /* Only changed by the writer thread holding the task */
+    uint64_t                       write_pos;
+    /* Statistics: the time the file-xfer started, the time it was last
+       handed to the writers, and how long it waited for a writer */
+    gint64                         start_time;
+    gint64                         queued_time;
+    gint64                         total_latency;
+    gint64                         max_latency;
+    unsigned int                   turns;
     uint64_t                       read_bytes;
+    /* The final path of the file, and the path it is written to */
     char                           *file_name;
+    char                           *part_path;
     uint64_t                       file_size;
     int                            file_xfer_nr;
     int                            file_xfer_total;
     int                            debug;
 } AgentFileXferTask;
 
+static void vdagent_file_xfer_task_write(gpointer data, gpointer user_data);
+static gboolean vdagent_file_xfer_task_written_cb(gpointer user_data);
+static void vdagent_file_xfer_task_unthrottle(AgentFileXferTask *task);
+static int vdagent_file_xfer_task_rename(struct vdagent_file_xfers *xfers,
+    AgentFileXferTask *task);
+
+/* Log the progress of a file-xfer, the signature allows using this with
+   g_hash_table_foreach() */
+static void vdagent_file_xfer_task_log_stats(gpointer key, gpointer value,
+    gpointer user_data)
+{
+    AgentFileXferTask *task = value;
+    gint64 elapsed, avg_latency = 0, max_latency;
+    uint64_t bytes;
+
+    g_mutex_lock(&task->lock);
+    elapsed = MAX(g_get_monotonic_time() - task->start_time, 1);
+    bytes = task->write_pos;
+    if (task->turns)
+        avg_latency = task->total_latency / task->turns;
+    max_latency = task->max_latency;
+    g_mutex_unlock(&task->lock);
+
+    syslog(LOG_DEBUG, "file-xfer: task %u %s: %"PRIu64"/%"PRIu64" bytes "
+           "in %.1f s, %.1f KiB/s, writer latency avg %.1f ms max %.1f ms",
+           task->id, task->file_name, bytes, task->file_size,
+           elapsed / 1e6, bytes * 1e6 / 1024 / elapsed,
+           avg_latency / 1e3, max_latency / 1e3);
+}
+
+static gboolean vdagent_file_xfers_log_stats(gpointer user_data)
+{
+    struct vdagent_file_xfers *xfers = user_data;
+
+    if (g_hash_table_size(xfers->xfers) == 0) {
+        xfers->stats_timeout = 0;
+        return G_SOURCE_REMOVE;
+    }
+
+    syslog(LOG_DEBUG, "file-xfer: %u active file-xfers",
+           g_hash_table_size(xfers->xfers));
+    g_hash_table_foreach(xfers->xfers, vdagent_file_xfer_task_log_stats, NULL);
+    return G_SOURCE_CONTINUE;
+}
+
 static void vdagent_file_xfer_task_free(gpointer data)
 {
     AgentFileXferTask *task = data;
 
     g_return_if_fail(task != NULL);
 
-    if (task->file_fd > 0) {
+    if (task->debug && task->start_time)
+        vdagent_file_xfer_task_log_stats(NULL, task, NULL);
+
+    /* Wait for the writer thread to be done with the task */
+    g_mutex_lock(&task->lock);
+    task->cancelled = 1;
+    while (task->writing)
+        g_cond_wait(&task->cond, &task->lock);
+    g_mutex_unlock(&task->lock);
+
+    if (task->written_id)
+        g_source_remove(task->written_id);
+    vdagent_file_xfer_task_unthrottle(task);
+    if (task->data_watch)
+        g_source_remove(task->data_watch);
+    if (task->data_fd != -1)
+        close(task->data_fd);
+    g_queue_foreach(&task->write_queue, (GFunc)g_bytes_unref, NULL);
+    g_queue_clear(&task->write_queue);
+    free(task->block);
+    g_free(task->read_buf);
+    free(task->resume_buf);
+    if (task->checksum)
+        g_checksum_free(task->checksum);
+    if (task->chunk_checksum)
+        g_checksum_free(task->chunk_checksum);
+    if (task->chunk_digests)
+        g_byte_array_free(task->chunk_digests, TRUE);
+    g_mutex_clear(&task->lock);
+    g_cond_clear(&task->cond);
+
+    if (task->file_fd > 0 && task->keep_partial && task->journal_pos > 0) {
+        syslog(LOG_INFO, "file-xfer: keeping partial file %s, %"PRIu64
+               " bytes of it can be resumed", task->part_path,
+               task->journal_pos);
+        close(task->file_fd);
+    } else if (task->file_fd > 0) {
         syslog(LOG_ERR, "file-xfer: Removing task %u and file %s due to error",
-               task->id, task->file_name);
+               task->id, task->part_path);
         close(task->file_fd);
-        unlink(task->file_name);
-    } else if (task->debug)
-        syslog(LOG_DEBUG, "file-xfer: Removing task %u %s",
-               task->id, task->file_name);
+        unlink(task->part_path);
+        if (task->journal_path)
+            unlink(task->journal_path);
+    } else {
+        if (task->debug)
+            syslog(LOG_DEBUG, "file-xfer: Removing task %u %s",
+                   task->id, task->file_name);
+        if (task->journal_path)
+            unlink(task->journal_path);
+    }
 
+    g_free(task->journal_path);
+    g_free(task->part_path);
     g_free(task->file_name);
     g_free(task);
 }
 
 struct vdagent_file_xfers *vdagent_file_xfers_create(
     struct udscs_connection *vdagentd, const char *save_dir,
-    int open_save_dir, int debug)
+    int open_save_dir, size_t block_size, int direct_io, int checksum,
+    int journal, int debug)
 {
     struct vdagent_file_xfers *xfers;
 
     xfers = g_malloc(sizeof(*xfers));
     xfers->xfers = g_hash_table_new_full(g_direct_hash, g_direct_equal,
                                          NULL, vdagent_file_xfer_task_free);
+    xfers->dir_names = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                             (GDestroyNotify)g_hash_table_destroy);
+    xfers->copy_numbers = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                g_free, NULL);
+    xfers->writers = g_thread_pool_new(vdagent_file_xfer_task_write, NULL,
+                                       FILE_XFER_WRITER_THREADS, FALSE, NULL);
     xfers->vdagentd = vdagentd;
     xfers->save_dir = g_strdup(save_dir);
+    xfers->journal_dir = g_build_filename(g_get_user_cache_dir(),
+                                          "spice-vdagent", "file-xfers", NULL);
     xfers->open_save_dir = open_save_dir;
+    if (block_size == 0)
+        block_size = FILE_XFER_DEFAULT_BLOCK_SIZE;
+    /* Round up to a multiple of the O_DIRECT alignment */
+    xfers->block_size = (block_size + FILE_XFER_DIRECT_IO_ALIGN - 1) &
+                        ~(size_t)(FILE_XFER_DIRECT_IO_ALIGN - 1);
+    xfers->direct_io = direct_io;
+    xfers->checksum = checksum;
+    xfers->journal = journal;
     xfers->debug = debug;
+    xfers->stats_timeout = 0;
+    xfers->throttled_tasks = 0;
+    xfers->resume_read_id = 0;
+    xfers->free_space_time = 0;
+    xfers->reserved_space = 0;
 
     return xfers;
 }
 
+static void vdagent_file_xfer_task_keep_partial(gpointer key, gpointer value,
+    gpointer user_data)
+{
+    AgentFileXferTask *task = value;
+
+    task->keep_partial = 1;
+}
+
 void vdagent_file_xfers_destroy(struct vdagent_file_xfers *xfers)
 {
     g_return_if_fail(xfers != NULL);
 
+    if (xfers->stats_timeout)
+        g_source_remove(xfers->stats_timeout);
+    /* We get destroyed when the client disconnects, or when we exit, keep
+       what has been received so far so that the file-xfers can be resumed */
+    g_hash_table_foreach(xfers->xfers, vdagent_file_xfer_task_keep_partial,
+                         NULL);
     g_hash_table_destroy(xfers->xfers);
+    if (xfers->resume_read_id)
+        g_source_remove(xfers->resume_read_id);
+    g_hash_table_destroy(xfers->dir_names);
+    g_hash_table_destroy(xfers->copy_numbers);
+    g_thread_pool_free(xfers->writers, FALSE, TRUE);
     g_free(xfers->save_dir);
+    g_free(xfers->journal_dir);
     g_free(xfers);
 }
 
@@ -118,6 +371,875 @@ static AgentFileXferTask *vdagent_file_xfers_get_task(
     return task;
 }
 
+/* Account for len bytes of task having been written to disk.
+   Return value: the final status of the file-xfer once it has completed,
+   -1 if more data is expected */
+static int vdagent_file_xfer_task_written(struct vdagent_file_xfers *xfers,
+    AgentFileXferTask *task, uint64_t len)
+{
+    int status;
+
+    task->read_bytes += len;
+    if (task->read_bytes < task->file_size)
+        return -1;
+
+    if (task->read_bytes == task->file_size) {
+        if (xfers->debug)
+            syslog(LOG_DEBUG, "file-xfer: task %u %s has completed",
+                   task->id, task->file_name);
+        if (task->file_size >= FILE_XFER_DROP_CACHE_SIZE)
+            posix_fadvise(task->file_fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(task->file_fd);
+        task->file_fd = -1;
+        if (xfers->open_save_dir &&
+                task->file_xfer_nr == task->file_xfer_total &&
+                g_hash_table_size(xfers->xfers) == 1) {
+            char buf[PATH_MAX];
+            snprintf(buf, PATH_MAX, "xdg-open '%s'&", xfers->save_dir);
+            status = system(buf);
+        }
+        status = VD_AGENT_FILE_XFER_STATUS_SUCCESS;
+    } else {
+        syslog(LOG_ERR, "file-xfer: error received too much data");
+        status = VD_AGENT_FILE_XFER_STATUS_ERROR;
+    }
+
+    return status;
+}
+
+/* Write all of data to the file
+   Return value: 0 on success, -1 on error with errno set */
+static int vdagent_file_xfer_task_write_data(AgentFileXferTask *task,
+    const uint8_t *data, size_t size)
+{
+    size_t pos;
+    ssize_t n;
+
+    for (pos = 0; pos < size; pos += n) {
+        n = write(task->file_fd, data + pos, size - pos);
+        if (n < 0) {
+            if (errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int vdagent_file_xfer_task_alloc_block(AgentFileXferTask *task)
+{
+    void *block;
+
+    if (task->block)
+        return 0;
+
+    errno = posix_memalign(&block, FILE_XFER_DIRECT_IO_ALIGN,
+                           task->block_size);
+    if (errno)
+        return -1;
+
+    task->block = block;
+    return 0;
+}
+
+/* Write out the data gathered in the block buffer when using O_DIRECT.
+   Only the last block of the file may be incomplete, it gets written without
+   O_DIRECT as its size is not aligned. */
+static int vdagent_file_xfer_task_flush_block(AgentFileXferTask *task)
+{
+    int flags;
+
+    if (task->block_fill < task->block_size) {
+        flags = fcntl(task->file_fd, F_GETFL);
+        if (flags == -1 ||
+                fcntl(task->file_fd, F_SETFL, flags & ~O_DIRECT) == -1)
+            return -1;
+    }
+
+    if (vdagent_file_xfer_task_write_data(task, task->block,
+                                          task->block_fill) < 0)
+        return -1;
+
+    task->block_fill = 0;
+    return 0;
+}
+
+/* Account for n bytes having been added to the block buffer, writing it out
+   once it is full, or once the end of the file is reached */
+static int vdagent_file_xfer_task_fill_block(AgentFileXferTask *task,
+    size_t n, uint64_t pos)
+{
+    task->block_fill += n;
+    if (task->block_fill < task->block_size && pos < task->file_size)
+        return 0;
+
+    return vdagent_file_xfer_task_flush_block(task);
+}
+
+/* Start the writeback of the data written so far and drop the data which
+   got written back since the last call from the page cache, this keeps a
+   large file-xfer from evicting the page cache of the rest of the desktop */
+static void vdagent_file_xfer_task_drop_cache(AgentFileXferTask *task,
+    uint64_t pos)
+{
+    if (task->direct_io || pos - task->drop_cache_pos < FILE_XFER_DROP_CACHE_SIZE)
+        return;
+
+    sync_file_range(task->file_fd, task->drop_cache_pos,
+                    pos - task->drop_cache_pos, SYNC_FILE_RANGE_WRITE);
+    posix_fadvise(task->file_fd, 0, task->drop_cache_pos,
+                  POSIX_FADV_DONTNEED);
+    task->drop_cache_pos = pos;
+}
+
+/* Write size bytes of data, which go at offset pos of the file, through
+   the aligned block buffer */
+static int vdagent_file_xfer_task_write_direct(AgentFileXferTask *task,
+    const uint8_t *data, size_t size, uint64_t pos)
+{
+    size_t done, n;
+
+    if (vdagent_file_xfer_task_alloc_block(task) < 0)
+        return -1;
+
+    for (done = 0; done < size; done += n) {
+        n = MIN(size - done, task->block_size - task->block_fill);
+        memcpy(task->block + task->block_fill, data + done, n);
+        if (vdagent_file_xfer_task_fill_block(task, n, pos + done + n) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int vdagent_file_xfer_task_store(AgentFileXferTask *task,
+    const uint8_t *data, size_t size, uint64_t pos)
+{
+    if (task->direct_io)
+        return vdagent_file_xfer_task_write_direct(task, data, size, pos);
+
+    return vdagent_file_xfer_task_write_data(task, data, size);
+}
+
+/* Save the digests of the first n_chunks chunks of the file to the journal,
+   after making sure that these chunks really are on disk */
+static void vdagent_file_xfer_task_save_journal(AgentFileXferTask *task,
+    uint64_t n_chunks)
+{
+    GKeyFile *keyfile;
+    GError *error = NULL;
+    gchar *digests, *data;
+    gsize size;
+
+    if (fdatasync(task->file_fd) < 0)
+        return;
+
+    digests = g_base64_encode(task->chunk_digests->data,
+                              n_chunks * FILE_XFER_DIGEST_SIZE);
+    keyfile = g_key_file_new();
+    g_key_file_set_string(keyfile, "vdagent-file-xfer-journal", "path",
+                          task->file_name);
+    g_key_file_set_uint64(keyfile, "vdagent-file-xfer-journal", "size",
+                          task->file_size);
+    g_key_file_set_string(keyfile, "vdagent-file-xfer-journal", "chunks",
+                          digests);
+    data = g_key_file_to_data(keyfile, &size, NULL);
+    if (g_file_set_contents(task->journal_path, data, size, &error)) {
+        task->journal_pos = n_chunks * FILE_XFER_JOURNAL_CHUNK_SIZE;
+    } else {
+        syslog(LOG_WARNING, "file-xfer: error writing journal %s: %s",
+               task->journal_path, error->message);
+        g_error_free(error);
+    }
+    g_free(data);
+    g_key_file_free(keyfile);
+    g_free(digests);
+}
+
+/* Add the data at offset pos of the file to the checksum of its chunk, and
+   update the journal every FILE_XFER_JOURNAL_INTERVAL */
+static void vdagent_file_xfer_task_journal_data(AgentFileXferTask *task,
+    const uint8_t *data, size_t size, uint64_t pos)
+{
+    uint8_t digest[FILE_XFER_DIGEST_SIZE];
+    gsize digest_len = sizeof(digest);
+    uint64_t end = pos + size, n_chunks;
+
+    g_checksum_update(task->chunk_checksum, data, size);
+    if (end % FILE_XFER_JOURNAL_CHUNK_SIZE && end < task->file_size)
+        return;
+
+    g_checksum_get_digest(task->chunk_checksum, digest, &digest_len);
+    g_checksum_reset(task->chunk_checksum);
+    g_byte_array_append(task->chunk_digests, digest, sizeof(digest));
+
+    /* Data still in the O_DIRECT block buffer is not on disk yet */
+    n_chunks = (end - task->block_fill) / FILE_XFER_JOURNAL_CHUNK_SIZE;
+    if (n_chunks * FILE_XFER_JOURNAL_CHUNK_SIZE >=
+            task->journal_pos + FILE_XFER_JOURNAL_INTERVAL)
+        vdagent_file_xfer_task_save_journal(task, n_chunks);
+}
+
+/* Compare the data at offset pos of a resumed file-xfer with the journal.
+   The data is gathered per chunk, chunks matching the journal are skipped,
+   the others get written. */
+static int vdagent_file_xfer_task_resume_data(AgentFileXferTask *task,
+    const uint8_t *data, size_t size, uint64_t pos)
+{
+    uint8_t digest[FILE_XFER_DIGEST_SIZE];
+    gsize digest_len = sizeof(digest);
+    uint8_t *journal_digest;
+    uint64_t chunk = pos / FILE_XFER_JOURNAL_CHUNK_SIZE;
+    void *buf;
+
+    if (!task->resume_buf) {
+        errno = posix_memalign(&buf, FILE_XFER_DIRECT_IO_ALIGN,
+                               FILE_XFER_JOURNAL_CHUNK_SIZE);
+        if (errno)
+            return -1;
+        task->resume_buf = buf;
+    }
+
+    memcpy(task->resume_buf + pos % FILE_XFER_JOURNAL_CHUNK_SIZE, data, size);
+    if ((pos + size) % FILE_XFER_JOURNAL_CHUNK_SIZE)
+        return 0;
+
+    g_checksum_update(task->chunk_checksum, task->resume_buf,
+                      FILE_XFER_JOURNAL_CHUNK_SIZE);
+    g_checksum_get_digest(task->chunk_checksum, digest, &digest_len);
+    g_checksum_reset(task->chunk_checksum);
+
+    journal_digest = task->chunk_digests->data + chunk * FILE_XFER_DIGEST_SIZE;
+    if (memcmp(digest, journal_digest, sizeof(digest)) == 0) {
+        if (lseek(task->file_fd, pos + size, SEEK_SET) < 0)
+            return -1;
+    } else {
+        task->resume_mismatches++;
+        memcpy(journal_digest, digest, sizeof(digest));
+        if (vdagent_file_xfer_task_write_data(task, task->resume_buf,
+                                              FILE_XFER_JOURNAL_CHUNK_SIZE) < 0)
+            return -1;
+    }
+
+    if (pos + size == task->resume_pos) {
+        if (task->debug)
+            syslog(LOG_DEBUG, "file-xfer: task %u resumed at %"PRIu64
+                   " bytes, %u of %"PRIu64" chunks differed", task->id,
+                   task->resume_pos, task->resume_mismatches, chunk + 1);
+        free(task->resume_buf);
+        task->resume_buf = NULL;
+    }
+    return 0;
+}
+
+/* Handle file data at the current write position of a journaled file-xfer */
+static int vdagent_file_xfer_task_consume(AgentFileXferTask *task,
+    const uint8_t *data, size_t size)
+{
+    uint64_t pos = task->write_pos;
+    size_t n;
+    int r;
+
+    for (; size; data += n, size -= n, pos += n) {
+        n = MIN(size, FILE_XFER_JOURNAL_CHUNK_SIZE -
+                      pos % FILE_XFER_JOURNAL_CHUNK_SIZE);
+        if (pos < task->resume_pos) {
+            r = vdagent_file_xfer_task_resume_data(task, data, n, pos);
+        } else {
+            r = vdagent_file_xfer_task_store(task, data, n, pos);
+            if (r == 0)
+                vdagent_file_xfer_task_journal_data(task, data, n, pos);
+        }
+        if (r < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Handle file data at the current write position of the file */
+static int vdagent_file_xfer_task_handle_data(AgentFileXferTask *task,
+    const uint8_t *data, size_t size)
+{
+    if (task->checksum)
+        g_checksum_update(task->checksum, data, size);
+
+    if (task->journal_path)
+        return vdagent_file_xfer_task_consume(task, data, size);
+
+    return vdagent_file_xfer_task_store(task, data, size, task->write_pos);
+}
+
+/* Move data from the pipe to the file. When the data does not need to be
+   looked at it is splice()-d to the file, without passing through user
+   space. It is read into read_buf when it gets hashed or journaled, when
+   writing with O_DIRECT, or when the file system does not support splice().
+   Return value: the number of bytes moved, 0 on EOF, -1 on error with
+   errno set (EAGAIN when the pipe is empty) */
+static ssize_t vdagent_file_xfer_task_read_pipe(AgentFileXferTask *task,
+    size_t len)
+{
+    ssize_t n;
+
+    if (!task->no_splice && !task->direct_io && !task->checksum &&
+            !task->journal_path) {
+        n = splice(task->data_fd, NULL, task->file_fd, NULL, len,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n >= 0 || errno != EINVAL)
+            return n;
+        task->no_splice = 1;
+    }
+
+    if (!task->read_buf)
+        task->read_buf = g_malloc(task->block_size);
+
+    n = read(task->data_fd, task->read_buf, MIN(len, task->block_size));
+    if (n > 0 && vdagent_file_xfer_task_handle_data(task, task->read_buf,
+                                                    n) < 0)
+        return -1;
+    return n;
+}
+
+/* Write the data of a FILE_XFER_DATA message to the file */
+static int vdagent_file_xfer_task_write_bytes(AgentFileXferTask *task,
+    GBytes *bytes)
+{
+    const uint8_t *data;
+    gsize size;
+
+    data = g_bytes_get_data(bytes, &size);
+    return vdagent_file_xfer_task_handle_data(task, data, size);
+}
+
+/* Load the journal of a previous, interrupted, file-xfer to path
+   Return value: 1 if the file-xfer can be resumed, 0 otherwise */
+static int vdagent_file_xfer_task_load_journal(
+    struct vdagent_file_xfers *xfers, AgentFileXferTask *task,
+    const char *path)
+{
+    GKeyFile *keyfile;
+    gchar *journal_path, *name, *journal_file = NULL, *digests = NULL;
+    gchar *part_path = NULL;
+    guchar *data = NULL;
+    gsize size = 0;
+    struct stat st;
+    int ret = 0;
+
+    name = g_compute_checksum_for_string(G_CHECKSUM_SHA1, path, -1);
+    journal_path = g_strdup_printf("%s/%s.journal", xfers->journal_dir, name);
+    g_free(name);
+
+    keyfile = g_key_file_new();
+    if (!g_key_file_load_from_file(keyfile, journal_path, G_KEY_FILE_NONE,
+                                   NULL))
+        goto out;
+
+    journal_file = g_key_file_get_string(keyfile, "vdagent-file-xfer-journal",
+                                         "path", NULL);
+    digests = g_key_file_get_string(keyfile, "vdagent-file-xfer-journal",
+                                    "chunks", NULL);
+    if (!journal_file || !digests || strcmp(journal_file, path) ||
+            g_key_file_get_uint64(keyfile, "vdagent-file-xfer-journal",
+                                  "size", NULL) != task->file_size)
+        goto out;
+
+    /* The partial file must still be there, as we left it */
+    part_path = g_strconcat(path, FILE_XFER_PART_SUFFIX, NULL);
+    if (stat(part_path, &st) < 0 || !S_ISREG(st.st_mode) ||
+            (uint64_t)st.st_size != task->file_size)
+        goto out;
+
+    data = g_base64_decode(digests, &size);
+    if (size == 0 || size % FILE_XFER_DIGEST_SIZE ||
+            size / FILE_XFER_DIGEST_SIZE * FILE_XFER_JOURNAL_CHUNK_SIZE >
+            task->file_size)
+        goto out;
+
+    task->chunk_digests = g_byte_array_new();
+    g_byte_array_append(task->chunk_digests, data, size);
+    task->resume_pos = size / FILE_XFER_DIGEST_SIZE *
+                       FILE_XFER_JOURNAL_CHUNK_SIZE;
+    task->journal_pos = task->resume_pos;
+    ret = 1;
+
+out:
+    if (ret) {
+        task->journal_path = journal_path;
+        task->part_path = part_path;
+    } else {
+        g_free(journal_path);
+        g_free(part_path);
+    }
+    g_free(data);
+    g_free(digests);
+    g_free(journal_file);
+    g_key_file_free(keyfile);
+    return ret;
+}
+
+/* For use with g_hash_table_find(), finds the task saving to the path
+   passed as user_data */
+static gboolean vdagent_file_xfer_task_has_path(gpointer key, gpointer value,
+    gpointer user_data)
+{
+    AgentFileXferTask *task = value;
+
+    return strcmp(task->file_name, user_data) == 0;
+}
+
+/* Start journaling a new file-xfer, so that it can be resumed */
+static void vdagent_file_xfer_task_start_journal(
+    struct vdagent_file_xfers *xfers, AgentFileXferTask *task)
+{
+    gchar *name;
+
+    if (g_mkdir_with_parents(xfers->journal_dir, S_IRWXU) == -1) {
+        syslog(LOG_WARNING, "file-xfer: failed to create dir %s, "
+               "file-xfers cannot be resumed", xfers->journal_dir);
+        return;
+    }
+
+    name = g_compute_checksum_for_string(G_CHECKSUM_SHA1, task->file_name, -1);
+    task->journal_path = g_strdup_printf("%s/%s.journal", xfers->journal_dir,
+                                         name);
+    g_free(name);
+    unlink(task->journal_path);
+    task->chunk_digests = g_byte_array_new();
+}
+
+/* Writer thread function: write all data available for the task to the
+   file, then report back to the main loop */
+static void vdagent_file_xfer_task_write(gpointer data, gpointer user_data)
+{
+    AgentFileXferTask *task = data;
+    GBytes *bytes;
+    ssize_t n;
+    int err;
+    gint64 latency;
+    uint64_t quantum_end;
+
+    g_mutex_lock(&task->lock);
+    latency = g_get_monotonic_time() - task->queued_time;
+    task->total_latency += latency;
+    task->max_latency = MAX(task->max_latency, latency);
+    task->turns++;
+
+    quantum_end = task->write_pos + FILE_XFER_WRITE_QUANTUM;
+    while (!task->cancelled && !task->write_errno && !task->data_eof) {
+        if (task->write_pos >= quantum_end) {
+            /* Give the other file-xfers a turn, the thread pool handles
+               tasks in the order in which they got queued */
+            task->queued_time = g_get_monotonic_time();
+            g_thread_pool_push(task->xfers->writers, task, NULL);
+            g_mutex_unlock(&task->lock);
+            return;
+        }
+
+        if (task->data_fd != -1) {
+            g_mutex_unlock(&task->lock);
+            /* Never read beyond the end of the file, any excess data sent by
+               the client is dropped by vdagentd once we close the pipe */
+            n = vdagent_file_xfer_task_read_pipe(task,
+                    MAX(task->file_size - task->write_pos, 1));
+            err = errno;
+            if (n > 0)
+                vdagent_file_xfer_task_drop_cache(task, task->write_pos + n);
+            g_mutex_lock(&task->lock);
+            if (n < 0) {
+                if (err == EINTR)
+                    continue;
+                if (err != EAGAIN)
+                    task->write_errno = err;
+                break;
+            }
+            if (n == 0) {
+                task->data_eof = 1;
+                break;
+            }
+            task->write_pos += n;
+            task->written += n;
+            if (task->write_pos >= task->file_size)
+                break;
+        } else {
+            bytes = g_queue_pop_head(&task->write_queue);
+            if (!bytes)
+                break;
+            g_mutex_unlock(&task->lock);
+            n = vdagent_file_xfer_task_write_bytes(task, bytes);
+            err = errno;
+            if (n == 0)
+                vdagent_file_xfer_task_drop_cache(task, task->write_pos +
+                                                  g_bytes_get_size(bytes));
+            g_mutex_lock(&task->lock);
+            if (n < 0) {
+                task->write_errno = err;
+            } else {
+                task->write_pos += g_bytes_get_size(bytes);
+                task->written += g_bytes_get_size(bytes);
+            }
+            task->write_queue_size -= g_bytes_get_size(bytes);
+            g_bytes_unref(bytes);
+        }
+    }
+
+    if (!task->cancelled && !task->written_id)
+        task->written_id = g_idle_add(vdagent_file_xfer_task_written_cb, task);
+    task->writing = 0;
+    g_cond_broadcast(&task->cond);
+    g_mutex_unlock(&task->lock);
+}
+
+/* Hand the task to a writer thread, must be called with task->lock held */
+static void vdagent_file_xfer_task_queue_write(AgentFileXferTask *task)
+{
+    if (task->writing)
+        return;
+
+    task->writing = 1;
+    task->queued_time = g_get_monotonic_time();
+    g_thread_pool_push(task->xfers->writers, task, NULL);
+}
+
+static gboolean vdagent_file_xfer_task_pipe_cb(gint fd, GIOCondition condition,
+    gpointer user_data)
+{
+    AgentFileXferTask *task = user_data;
+
+    /* Stop watching until the writer thread has drained the pipe */
+    task->data_watch = 0;
+    g_mutex_lock(&task->lock);
+    vdagent_file_xfer_task_queue_write(task);
+    g_mutex_unlock(&task->lock);
+    return G_SOURCE_REMOVE;
+}
+
+/* Report the outcome of the file-xfer to vdagentd and remove the task. On
+   success, when checksums are enabled, the SHA-256 of the file data is
+   passed along so that the client can verify it without reading the file
+   again. Note this is not negotiated with the client, the digest simply
+   follows the VDAgentFileXferStatusMessage, which is why it is opt-in. */
+static void vdagent_file_xfer_task_finish(struct vdagent_file_xfers *xfers,
+    AgentFileXferTask *task, int status)
+{
+    uint8_t digest[FILE_XFER_DIGEST_SIZE];
+    gsize digest_len = 0;
+    uint32_t id = task->id;
+
+    if (status == VD_AGENT_FILE_XFER_STATUS_SUCCESS &&
+            vdagent_file_xfer_task_rename(xfers, task) < 0) {
+        unlink(task->part_path);
+        status = VD_AGENT_FILE_XFER_STATUS_ERROR;
+    }
+
+    if (status == VD_AGENT_FILE_XFER_STATUS_SUCCESS && task->checksum) {
+        digest_len = sizeof(digest);
+        g_checksum_get_digest(task->checksum, digest, &digest_len);
+        syslog(LOG_INFO, "file-xfer: %s sha256 %s", task->file_name,
+               g_checksum_get_string(task->checksum));
+    }
+
+    udscs_write(xfers->vdagentd, VDAGENTD_FILE_XFER_STATUS, id, status,
+                digest_len ? digest : NULL, digest_len);
+    g_hash_table_remove(xfers->xfers, GUINT_TO_POINTER(id));
+}
+
+static gboolean vdagent_file_xfers_resume_read(gpointer user_data)
+{
+    struct vdagent_file_xfers *xfers = user_data;
+    struct udscs_connection *conn = xfers->vdagentd;
+
+    xfers->resume_read_id = 0;
+    if (xfers->throttled_tasks)
+        return G_SOURCE_REMOVE;
+
+    if (xfers->debug)
+        syslog(LOG_DEBUG, "file-xfer: disk caught up, resuming reading");
+    /* This dispatches the messages received in the mean time, which may
+       destroy xfers, so it must be the last thing we do */
+    udscs_set_read_paused(&conn, 0);
+    return G_SOURCE_REMOVE;
+}
+
+/* Stop reading from vdagentd when the disk cannot keep up with the data of
+   the task, this in turn throttles the client */
+static void vdagent_file_xfer_task_throttle(AgentFileXferTask *task)
+{
+    struct vdagent_file_xfers *xfers = task->xfers;
+
+    if (task->throttled)
+        return;
+
+    if (xfers->debug && xfers->throttled_tasks == 0)
+        syslog(LOG_DEBUG, "file-xfer: disk is not keeping up, pausing reading");
+    task->throttled = 1;
+    xfers->throttled_tasks++;
+    udscs_set_read_paused(&xfers->vdagentd, 1);
+}
+
+/* Resume reading from vdagentd once the disk has caught up with all tasks,
+   this is done from an idle callback as it dispatches any messages which
+   were received before reading got paused */
+static void vdagent_file_xfer_task_unthrottle(AgentFileXferTask *task)
+{
+    struct vdagent_file_xfers *xfers = task->xfers;
+
+    if (!task->throttled)
+        return;
+
+    task->throttled = 0;
+    xfers->throttled_tasks--;
+    if (xfers->throttled_tasks == 0 && !xfers->resume_read_id)
+        xfers->resume_read_id = g_idle_add(vdagent_file_xfers_resume_read,
+                                           xfers);
+}
+
+/* Called in the main loop after a writer thread is done with the task */
+static gboolean vdagent_file_xfer_task_written_cb(gpointer user_data)
+{
+    AgentFileXferTask *task = user_data;
+    struct vdagent_file_xfers *xfers = task->xfers;
+    uint64_t written;
+    size_t queued;
+    int write_errno, data_eof, status;
+
+    g_mutex_lock(&task->lock);
+    task->written_id = 0;
+    written = task->written;
+    task->written = 0;
+    queued = task->write_queue_size;
+    write_errno = task->write_errno;
+    data_eof = task->data_eof;
+    /* Make sure no writer thread is using the file when it gets closed */
+    if (write_errno || task->read_bytes + written >= task->file_size) {
+        task->cancelled = 1;
+        while (task->writing)
+            g_cond_wait(&task->cond, &task->lock);
+    }
+    g_mutex_unlock(&task->lock);
+
+    if (write_errno) {
+        syslog(LOG_ERR, "file-xfer: error writing %s: %s", task->file_name,
+               strerror(write_errno));
+        status = VD_AGENT_FILE_XFER_STATUS_ERROR;
+    } else {
+        status = vdagent_file_xfer_task_written(xfers, task, written);
+    }
+
+    if (status == -1) {
+        if (queued <= FILE_XFER_WRITE_QUEUE_SIZE / 2)
+            vdagent_file_xfer_task_unthrottle(task);
+        /* On EOF vdagentd closed the pipe, the file-xfer got cancelled or
+           failed, we get told through a VDAGENTD_FILE_XFER_STATUS msg */
+        if (task->data_fd != -1 && !data_eof)
+            task->data_watch = g_unix_fd_add(task->data_fd,
+                                             G_IO_IN | G_IO_HUP | G_IO_ERR,
+                                             vdagent_file_xfer_task_pipe_cb,
+                                             task);
+        return G_SOURCE_REMOVE;
+    }
+
+    vdagent_file_xfer_task_finish(xfers, task, status);
+    return G_SOURCE_REMOVE;
+}
+
+/* open() the file of the task, with O_DIRECT if wanted and supported */
+static int vdagent_file_xfer_task_open(AgentFileXferTask *task,
+    const char *path, int flags)
+{
+    int fd;
+
+    fd = open(path, flags | O_WRONLY | (task->direct_io ? O_DIRECT : 0), 0644);
+    if (fd == -1 && task->direct_io && errno == EINVAL) {
+        /* The file system does not support O_DIRECT */
+        task->direct_io = 0;
+        fd = open(path, flags | O_WRONLY, 0644);
+    }
+    return fd;
+}
+
+/* Return the set of names of the files in dir, which is read only once */
+static GHashTable *vdagent_file_xfers_get_dir_names(
+    struct vdagent_file_xfers *xfers, const char *dir)
+{
+    GHashTable *names;
+    const gchar *name;
+    GDir *gdir;
+
+    names = g_hash_table_lookup(xfers->dir_names, dir);
+    if (names)
+        return names;
+
+    names = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    gdir = g_dir_open(dir, 0, NULL);
+    if (gdir) {
+        while ((name = g_dir_read_name(gdir)))
+            g_hash_table_add(names, g_strdup(name));
+        g_dir_close(gdir);
+    }
+    g_hash_table_insert(xfers->dir_names, g_strdup(dir), names);
+    return names;
+}
+
+/* Return the name of copy number copy of the file named base, which has
+   " (n)" added before its extension */
+static char *vdagent_file_xfers_copy_name(const char *base, guint copy)
+{
+    const char *extension = strrchr(base, '.');
+    int basename_len = extension != NULL ? extension - base : strlen(base);
+
+    if (copy == 0)
+        return g_strdup(base);
+
+    return g_strdup_printf("%.*s (%u)%s", basename_len, base, copy,
+                           extension ? extension : "");
+}
+
+/* Create the file of the task, adding " (n)" before the extension of its
+   name if file_path already exists. The data is written to the file under
+   its name with FILE_XFER_PART_SUFFIX added, which is created with O_EXCL,
+   so files created behind our back do not get overwritten.
+   Return value: the final path of the file, NULL on error */
+static char *vdagent_file_xfers_create_file(struct vdagent_file_xfers *xfers,
+    AgentFileXferTask *task, const char *dir, const char *file_path)
+{
+    GHashTable *names;
+    struct stat st;
+    char *base, *name = NULL, *path = NULL, *part_path = NULL;
+    int err;
+    guint copy;
+
+    names = vdagent_file_xfers_get_dir_names(xfers, dir);
+    base = g_path_get_basename(file_path);
+    copy = GPOINTER_TO_UINT(g_hash_table_lookup(xfers->copy_numbers,
+                                                file_path));
+
+    for (;; copy++) {
+        g_free(name);
+        name = vdagent_file_xfers_copy_name(base, copy);
+        if (g_hash_table_contains(names, name))
+            continue;
+
+        path = g_build_filename(dir, name, NULL);
+        part_path = g_strconcat(path, FILE_XFER_PART_SUFFIX, NULL);
+        if (lstat(path, &st) == 0) {
+            err = EEXIST;
+        } else {
+            task->file_fd = vdagent_file_xfer_task_open(task, part_path,
+                                                        O_CREAT | O_EXCL);
+            if (task->file_fd != -1)
+                break;
+            err = errno;
+        }
+
+        g_free(path);
+        g_free(part_path);
+        path = part_path = NULL;
+        if (err != EEXIST) {
+            errno = err;
+            break;
+        }
+        g_hash_table_add(names, name);
+        name = NULL;
+    }
+
+    if (path) {
+        /* Reserve the final name for the task */
+        g_hash_table_add(names, name);
+        g_hash_table_insert(xfers->copy_numbers, g_strdup(file_path),
+                            GUINT_TO_POINTER(copy + 1));
+        task->part_path = part_path;
+    } else {
+        g_free(name);
+    }
+    g_free(base);
+    return path;
+}
+
+/* rename() which fails with EEXIST rather than replacing an existing file
+   Return value: 0 on success, -1 on error with errno set */
+static int vdagent_file_xfers_rename_noreplace(const char *from,
+    const char *to)
+{
+    struct stat st;
+
+#ifdef RENAME_NOREPLACE
+    if (renameat2(AT_FDCWD, from, AT_FDCWD, to, RENAME_NOREPLACE) == 0)
+        return 0;
+    if (errno != EINVAL && errno != ENOSYS)
+        return -1;
+#endif
+    /* link() does not replace existing files either */
+    if (link(from, to) == 0)
+        return unlink(from);
+    if (errno == EEXIST)
+        return -1;
+
+    /* The file system does not support hard links */
+    if (lstat(to, &st) == 0) {
+        errno = EEXIST;
+        return -1;
+    }
+    return rename(from, to);
+}
+
+/* Give the completed file of the task its final name, should a file with
+   that name have been created behind our back, " (n)" gets added to it.
+   Return value: 0 on success, -1 on error */
+static int vdagent_file_xfer_task_rename(struct vdagent_file_xfers *xfers,
+    AgentFileXferTask *task)
+{
+    GHashTable *names;
+    char *dir, *base, *name, *path = NULL;
+    guint copy;
+    int ret = -1;
+
+    if (vdagent_file_xfers_rename_noreplace(task->part_path,
+                                            task->file_name) == 0)
+        return 0;
+    if (errno != EEXIST) {
+        syslog(LOG_ERR, "file-xfer: failed to rename %s to %s: %m",
+               task->part_path, task->file_name);
+        return -1;
+    }
+
+    dir = g_path_get_dirname(task->file_name);
+    base = g_path_get_basename(task->file_name);
+    names = vdagent_file_xfers_get_dir_names(xfers, dir);
+    for (copy = 1;; copy++) {
+        name = vdagent_file_xfers_copy_name(base, copy);
+        if (g_hash_table_contains(names, name)) {
+            g_free(name);
+            continue;
+        }
+        g_hash_table_add(names, name);
+
+        path = g_build_filename(dir, name, NULL);
+        if (vdagent_file_xfers_rename_noreplace(task->part_path, path) == 0) {
+            ret = 0;
+            break;
+        }
+        if (errno != EEXIST) {
+            syslog(LOG_ERR, "file-xfer: failed to rename %s to %s: %m",
+                   task->part_path, path);
+            break;
+        }
+        g_free(path);
+        path = NULL;
+    }
+
+    if (ret == 0) {
+        syslog(LOG_INFO, "file-xfer: %s already exists, saved as %s",
+               task->file_name, path);
+        g_free(task->file_name);
+        task->file_name = path;
+    } else {
+        g_free(path);
+    }
+    g_free(base);
+    g_free(dir);
+    return ret;
+}
+
 /* Parse start message then create a new file xfer task */
 static AgentFileXferTask *vdagent_parse_start_msg(
     VDAgentFileXferStartMessage *msg)
@@ -137,6 +1259,10 @@ static AgentFileXferTask *vdagent_parse_start_msg(
     }
     task = g_new0(AgentFileXferTask, 1);
     task->id = msg->id;
+    task->data_fd = -1;
+    g_mutex_init(&task->lock);
+    g_cond_init(&task->cond);
+    g_queue_init(&task->write_queue);
     task->file_name = g_key_file_get_string(
         keyfile, "vdagent-file-xfer", "name", &error);
     if (error) {
@@ -180,13 +1306,62 @@ static uint64_t get_free_space_available(const char *path)
     return stat.f_bsize * stat.f_bavail;
 }
 
+/* Sparse files only take up space as they are written, so the space they
+   still need is not reflected in the free space reported by statvfs() */
+static void vdagent_file_xfer_task_add_unallocated(gpointer key,
+    gpointer value, gpointer user_data)
+{
+    AgentFileXferTask *task = value;
+    uint64_t *unallocated = user_data;
+
+    if (task->sparse)
+        *unallocated += task->file_size - MIN(task->read_bytes,
+                                              task->file_size);
+}
+
+/* Reserve size bytes of the free space of save_dir, the free space is only
+   queried again when the last figure is too old, or when the reservation
+   does not fit in it. Files are allocated up front, so once they are
+   created they are accounted for by the new figure.
+   Return value: TRUE on success, FALSE if there is not enough space, with
+   the free space in *free_space */
+static gboolean vdagent_file_xfers_reserve_space(
+    struct vdagent_file_xfers *xfers, uint64_t size, uint64_t *free_space)
+{
+    gint64 now = g_get_monotonic_time();
+
+    if (now - xfers->free_space_time > FILE_XFER_FREE_SPACE_MAX_AGE ||
+            xfers->reserved_space + size > xfers->free_space) {
+        xfers->free_space = get_free_space_available(xfers->save_dir);
+        xfers->free_space_time = now;
+        xfers->reserved_space = 0;
+        g_hash_table_foreach(xfers->xfers,
+                             vdagent_file_xfer_task_add_unallocated,
+                             &xfers->reserved_space);
+    }
+
+    if (xfers->reserved_space + size > xfers->free_space) {
+        *free_space = xfers->free_space - MIN(xfers->reserved_space,
+                                              xfers->free_space);
+        return FALSE;
+    }
+
+    xfers->reserved_space += size;
+    return TRUE;
+}
+
+static void vdagent_file_xfers_release_space(struct vdagent_file_xfers *xfers,
+    uint64_t size)
+{
+    xfers->reserved_space -= MIN(size, xfers->reserved_space);
+}
+
 void vdagent_file_xfers_start(struct vdagent_file_xfers *xfers,
-    VDAgentFileXferStartMessage *msg)
+    VDAgentFileXferStartMessage *msg, int data_fd)
 {
     AgentFileXferTask *task;
     char *dir = NULL, *path = NULL, *file_path = NULL;
-    struct stat st;
-    int i;
+    int resume = 0, reserved = 0;
     uint64_t free_space;
 
     g_return_if_fail(xfers != NULL);
@@ -194,20 +1369,40 @@ void vdagent_file_xfers_start(struct vdagent_file_xfers *xfers,
     if (g_hash_table_lookup(xfers->xfers, GUINT_TO_POINTER(msg->id))) {
         syslog(LOG_ERR, "file-xfer: error id %u already exists, ignoring!",
                msg->id);
+        if (data_fd != -1)
+            close(data_fd);
         return;
     }
 
     task = vdagent_parse_start_msg(msg);
     if (task == NULL) {
+        if (data_fd != -1)
+            close(data_fd);
         goto error;
     }
 
+    /* Start every batch of file-xfers with fresh directory listings */
+    if (g_hash_table_size(xfers->xfers) == 0) {
+        g_hash_table_remove_all(xfers->dir_names);
+        g_hash_table_remove_all(xfers->copy_numbers);
+    }
+
     task->debug = xfers->debug;
+    task->xfers = xfers;
+    task->data_fd = data_fd;
 
     file_path = g_build_filename(xfers->save_dir, task->file_name, NULL);
 
-    free_space = get_free_space_available(xfers->save_dir);
-    if (task->file_size > free_space) {
+    /* The file of an interrupted file-xfer already has its space allocated.
+       A file-xfer to the same path which is still in progress owns the
+       file and its journal, the new one then gets a name of its own. */
+    if (xfers->journal && task->file_size >= FILE_XFER_JOURNAL_MIN_SIZE &&
+            !g_hash_table_find(xfers->xfers, vdagent_file_xfer_task_has_path,
+                               file_path))
+        resume = vdagent_file_xfer_task_load_journal(xfers, task, file_path);
+
+    if (!resume && !vdagent_file_xfers_reserve_space(xfers, task->file_size,
+                                                     &free_space)) {
         gchar *free_space_str, *file_size_str;
 #if GLIB_CHECK_VERSION(2, 30, 0)
         free_space_str = g_format_size(free_space);
@@ -232,6 +1427,7 @@ void vdagent_file_xfers_start(struct vdagent_file_xfers *xfers,
         g_free(dir);
         return;
     }
+    reserved = !resume;
 
     dir = g_path_get_dirname(file_path);
     if (g_mkdir_with_parents(dir, S_IRWXU) == -1) {
@@ -239,43 +1435,73 @@ void vdagent_file_xfers_start(struct vdagent_file_xfers *xfers,
         goto error;
     }
 
-    path = g_strdup(file_path);
-    for (i = 0; i < 64 && (stat(path, &st) == 0 || errno != ENOENT); i++) {
-        g_free(path);
-        char *extension = strrchr(file_path, '.');
-        int basename_len = extension != NULL ? extension - file_path : strlen(file_path);
-        path = g_strdup_printf("%.*s (%i)%s", basename_len, file_path,
-                               i + 1, extension ? extension : "");
-    }
-    g_free(task->file_name);
-    task->file_name = path;
-    if (i == 64) {
-        syslog(LOG_ERR, "file-xfer: more than 63 copies of %s exist?",
-               file_path);
-        goto error;
+    task->block_size = xfers->block_size;
+    task->direct_io = xfers->direct_io &&
+                      task->file_size >= FILE_XFER_DIRECT_IO_MIN_SIZE;
+    if (resume) {
+        path = g_strdup(file_path);
+        task->file_fd = vdagent_file_xfer_task_open(task, task->part_path, 0);
+        /* Keep other file-xfers from picking the same name */
+        g_hash_table_add(vdagent_file_xfers_get_dir_names(xfers, dir),
+                         g_path_get_basename(path));
+    } else {
+        path = vdagent_file_xfers_create_file(xfers, task, dir, file_path);
     }
-
-    task->file_fd = open(path, O_CREAT | O_WRONLY, 0644);
     if (task->file_fd == -1) {
         syslog(LOG_ERR, "file-xfer: failed to create file %s: %s",
-               path, strerror(errno));
+               file_path, strerror(errno));
+        g_free(path);
         goto error;
     }
+    g_free(task->file_name);
+    task->file_name = path;
 
-    if (ftruncate(task->file_fd, task->file_size) < 0) {
-        syslog(LOG_ERR, "file-xfer: err reserving %"PRIu64" bytes for %s: %s",
-               task->file_size, path, strerror(errno));
-        goto error;
+    /* Allocate the blocks of the file now, so that we run out of space
+       before starting rather than halfway through, and so that the file
+       does not get fragmented. ftruncate() merely sets the size of the file
+       for file systems without fallocate() support. */
+    if (task->file_size > 0 &&
+            fallocate(task->file_fd, 0, 0, task->file_size) < 0) {
+        task->sparse = 1;
+        if (errno != EOPNOTSUPP ||
+                ftruncate(task->file_fd, task->file_size) < 0) {
+            syslog(LOG_ERR, "file-xfer: err reserving %"PRIu64" bytes for %s: %s",
+                   task->file_size, path, strerror(errno));
+            goto error;
+        }
     }
 
+    if (xfers->journal && task->file_size >= FILE_XFER_JOURNAL_MIN_SIZE &&
+            !resume)
+        vdagent_file_xfer_task_start_journal(xfers, task);
+    if (task->journal_path)
+        task->chunk_checksum = g_checksum_new(G_CHECKSUM_SHA256);
+    if (xfers->checksum)
+        task->checksum = g_checksum_new(G_CHECKSUM_SHA256);
+
+    if (task->data_fd != -1)
+        task->data_watch = g_unix_fd_add(task->data_fd,
+                                         G_IO_IN | G_IO_HUP | G_IO_ERR,
+                                         vdagent_file_xfer_task_pipe_cb, task);
+
+    task->start_time = g_get_monotonic_time();
     g_hash_table_insert(xfers->xfers, GUINT_TO_POINTER(msg->id), task);
+    if (xfers->debug && !xfers->stats_timeout)
+        xfers->stats_timeout = g_timeout_add_seconds(FILE_XFER_STATS_INTERVAL,
+                                                     vdagent_file_xfers_log_stats,
+                                                     xfers);
 
     if (xfers->debug)
-        syslog(LOG_DEBUG, "file-xfer: Adding task %u %s %"PRIu64" bytes",
-               task->id, path, task->file_size);
+        syslog(LOG_DEBUG, "file-xfer: Adding task %u %s %"PRIu64" bytes%s",
+               task->id, path, task->file_size, resume ? ", resuming" : "");
 
     udscs_write(xfers->vdagentd, VDAGENTD_FILE_XFER_STATUS,
                 msg->id, VD_AGENT_FILE_XFER_STATUS_CAN_SEND_DATA, NULL, 0);
+
+    /* Nothing will ever come through the pipe for an empty file */
+    if (task->data_fd != -1 && task->file_size == 0)
+        vdagent_file_xfer_task_finish(xfers, task,
+                                      vdagent_file_xfer_task_written(xfers, task, 0));
     g_free(file_path);
     g_free(dir);
     return ;
@@ -283,6 +1509,8 @@ void vdagent_file_xfers_start(struct vdagent_file_xfers *xfers,
 error:
     udscs_write(xfers->vdagentd, VDAGENTD_FILE_XFER_STATUS,
                 msg->id, VD_AGENT_FILE_XFER_STATUS_ERROR, NULL, 0);
+    if (reserved)
+        vdagent_file_xfers_release_space(xfers, task->file_size);
     if (task)
         vdagent_file_xfer_task_free(task);
     g_free(file_path);
@@ -315,7 +1543,9 @@ void vdagent_file_xfers_data(struct vdagent_file_xfers *xfers,
     VDAgentFileXferDataMessage *msg)
 {
     AgentFileXferTask *task;
-    int len, status = -1;
+    GBytes *bytes, *data;
+    uint8_t *buf;
+    int full;
 
     g_return_if_fail(xfers != NULL);
 
@@ -323,40 +1553,30 @@ void vdagent_file_xfers_data(struct vdagent_file_xfers *xfers,
     if (!task)
         return;
 
-    len = write(task->file_fd, msg->data, msg->size);
-    if (len == msg->size) {
-        task->read_bytes += msg->size;
-        if (task->read_bytes >= task->file_size) {
-            if (task->read_bytes == task->file_size) {
-                if (xfers->debug)
-                    syslog(LOG_DEBUG, "file-xfer: task %u %s has completed",
-                           task->id, task->file_name);
-                close(task->file_fd);
-                task->file_fd = -1;
-                if (xfers->open_save_dir &&
-                        task->file_xfer_nr == task->file_xfer_total &&
-                        g_hash_table_size(xfers->xfers) == 1) {
-                    char buf[PATH_MAX];
-                    snprintf(buf, PATH_MAX, "xdg-open '%s'&", xfers->save_dir);
-                    status = system(buf);
-                }
-                status = VD_AGENT_FILE_XFER_STATUS_SUCCESS;
-            } else {
-                syslog(LOG_ERR, "file-xfer: error received too much data");
-                status = VD_AGENT_FILE_XFER_STATUS_ERROR;
-            }
-        }
+    /* Take over the buffer the message was received in, rather than
+       copying the data */
+    buf = udscs_steal_data(xfers->vdagentd);
+    if (buf) {
+        bytes = g_bytes_new_take(buf, sizeof(*msg) + msg->size);
+        data = g_bytes_new_from_bytes(bytes, sizeof(*msg), msg->size);
+        g_bytes_unref(bytes);
     } else {
-        syslog(LOG_ERR, "file-xfer: error writing %s: %s", task->file_name,
-               strerror(errno));
-        status = VD_AGENT_FILE_XFER_STATUS_ERROR;
+        data = g_bytes_new(msg->data, msg->size);
     }
 
-    if (status != -1) {
-        udscs_write(xfers->vdagentd, VDAGENTD_FILE_XFER_STATUS,
-                    msg->id, status, NULL, 0);
-        g_hash_table_remove(xfers->xfers, GUINT_TO_POINTER(msg->id));
+    g_mutex_lock(&task->lock);
+    if (!task->write_errno) {
+        g_queue_push_tail(&task->write_queue, data);
+        task->write_queue_size += g_bytes_get_size(data);
+        vdagent_file_xfer_task_queue_write(task);
+    } else {
+        g_bytes_unref(data);
     }
+    full = task->write_queue_size >= FILE_XFER_WRITE_QUEUE_SIZE;
+    g_mutex_unlock(&task->lock);
+
+    if (full)
+        vdagent_file_xfer_task_throttle(task);
 }
 
 void vdagent_file_xfers_error_disabled(struct udscs_connection *vdagentd, uint32_t msg_id)
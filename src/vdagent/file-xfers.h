@@ -26,13 +26,23 @@
 
 struct vdagent_file_xfers;
 
+/* block_size is the size of the blocks in which file data is written to
+   disk, 0 selects the default. When direct_io is set, large files are
+   written with O_DIRECT, bypassing the page cache. When checksum is set,
+   a SHA-256 of every file is computed and reported on success. When
+   journal is set, large file-xfers which get interrupted are kept, so that
+   they can be resumed. */
 struct vdagent_file_xfers *vdagent_file_xfers_create(
         struct udscs_connection *vdagentd, const char *save_dir,
-        int open_save_dir, int debug);
+        int open_save_dir, size_t block_size, int direct_io, int checksum,
+        int journal, int debug);
 void vdagent_file_xfers_destroy(struct vdagent_file_xfers *xfer);
 
+/* If data_fd is not -1 the data of the file-xfer is read from data_fd, and
+   not passed through vdagent_file_xfers_data(). This takes ownership of
+   data_fd. */
 void vdagent_file_xfers_start(struct vdagent_file_xfers *xfers,
-    VDAgentFileXferStartMessage *msg);
+    VDAgentFileXferStartMessage *msg, int data_fd);
 void vdagent_file_xfers_status(struct vdagent_file_xfers *xfers,
     VDAgentFileXferStatusMessage *msg);
 void vdagent_file_xfers_data(struct vdagent_file_xfers *xfers,
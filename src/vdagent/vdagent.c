@@ -51,6 +51,8 @@ typedef struct VDAgent {
     GIOChannel *x11_channel;
 
     GMainLoop *loop;
+    /* When we started (re)connecting, for the startup timing trace */
+    gint64 start_time;
 } VDAgent;
 
 static int quit = 0;
@@ -62,6 +64,10 @@ static gboolean debug = FALSE;
 static gboolean x11_sync = FALSE;
 static gboolean do_daemonize = TRUE;
 static gint fx_open_dir = -1;
+static gint fx_block_size = 0;
+static gboolean fx_direct_io = FALSE;
+static gboolean fx_checksum = FALSE;
+static gboolean fx_journal = FALSE;
 static gchar *fx_dir = NULL;
 static gchar *portdev = NULL;
 static gchar *vdagentd_socket = NULL;
@@ -85,6 +91,19 @@ static GOptionEntry entries[] = {
     { "file-xfer-open-dir", 'o', 0,
        G_OPTION_ARG_INT, &fx_open_dir,
        "Open directory after completing file transfer", "<0|1>" },
+    { "file-xfer-block-size", 'b', 0,
+       G_OPTION_ARG_INT, &fx_block_size,
+       "Size of the blocks in which transferred files are written", "<bytes>" },
+    { "file-xfer-direct-io", 'D', 0,
+       G_OPTION_ARG_NONE, &fx_direct_io,
+       "Write large transferred files with O_DIRECT", NULL },
+    { "file-xfer-checksum", 'c', 0,
+       G_OPTION_ARG_NONE, &fx_checksum,
+       "Compute the SHA-256 of transferred files", NULL },
+    { "file-xfer-journal", 'j', 0,
+       G_OPTION_ARG_NONE, &fx_journal,
+       "Keep interrupted large file transfers, so that they can be resumed",
+       NULL },
     { "x11-abort-on-error", 'y', G_OPTION_FLAG_HIDDEN,
       G_OPTION_ARG_NONE, &x11_sync,
       "Aborts on errors from X11", NULL },
@@ -140,7 +159,10 @@ static gboolean vdagent_init_file_xfer(VDAgent *agent)
         fx_open_dir = !vdagent_x11_has_icons_on_desktop(agent->x11);
 
     agent->xfers = vdagent_file_xfers_create(agent->conn, xfer_dir,
-                                             fx_open_dir, debug);
+                                             fx_open_dir,
+                                             MAX(fx_block_size, 0),
+                                             fx_direct_io, fx_checksum,
+                                             fx_journal, debug);
     return (agent->xfers != NULL);
 }
 
@@ -184,15 +206,26 @@ static void daemon_read_complete(struct udscs_connection **connp,
             version_mismatch = 1;
         }
         break;
-    case VDAGENTD_FILE_XFER_START:
-        if (agent->xfers != NULL) {
+    case VDAGENTD_FILE_XFER_START: {
+        /* arg1 is set when the data is passed through a pipe */
+        int data_fd = header->arg1 ? udscs_steal_fd(*connp) : -1;
+        if (header->arg1 && data_fd == -1) {
+            syslog(LOG_ERR, "file-xfer: did not receive the data pipe");
+            udscs_write(*connp, VDAGENTD_FILE_XFER_STATUS,
+                        ((VDAgentFileXferStartMessage *)data)->id,
+                        VD_AGENT_FILE_XFER_STATUS_ERROR, NULL, 0);
+        } else if (agent->xfers != NULL) {
             vdagent_file_xfers_start(agent->xfers,
-                                     (VDAgentFileXferStartMessage *)data);
+                                     (VDAgentFileXferStartMessage *)data,
+                                     data_fd);
         } else {
+            if (data_fd != -1)
+                close(data_fd);
             vdagent_file_xfers_error_disabled(*connp,
                                               ((VDAgentFileXferStartMessage *)data)->id);
         }
         break;
+    }
     case VDAGENTD_FILE_XFER_STATUS:
         if (agent->xfers != NULL) {
             vdagent_file_xfers_status(agent->xfers,
@@ -324,6 +357,7 @@ static VDAgent *vdagent_new(void)
     VDAgent *agent = g_new0(VDAgent, 1);
 
     agent->loop = g_main_loop_new(NULL, FALSE);
+    agent->start_time = g_get_monotonic_time();
 
     g_unix_signal_add(SIGINT, vdagent_signal_handler, agent);
     g_unix_signal_add(SIGHUP, vdagent_signal_handler, agent);
@@ -349,6 +383,7 @@ static void vdagent_destroy(VDAgent *agent)
 static gboolean vdagent_init_async_cb(gpointer user_data)
 {
     VDAgent *agent = user_data;
+    gint64 connected;
 
     agent->conn = udscs_connect(vdagentd_socket,
                                 daemon_read_complete, daemon_disconnect_cb,
@@ -358,6 +393,7 @@ static gboolean vdagent_init_async_cb(gpointer user_data)
         return G_SOURCE_REMOVE;
     }
     udscs_set_user_data(agent->conn, agent);
+    connected = g_get_monotonic_time();
 
     agent->x11 = vdagent_x11_create(agent->conn, debug, x11_sync);
     if (agent->x11 == NULL)
@@ -374,6 +410,16 @@ static gboolean vdagent_init_async_cb(gpointer user_data)
     if (!vdagent_init_file_xfer(agent))
         syslog(LOG_WARNING, "File transfer is disabled");
 
+    if (debug) {
+        gint64 now = g_get_monotonic_time();
+
+        syslog(LOG_DEBUG, "startup: ready after %.1f ms, of which %.1f ms "
+               "connecting to vdagentd and %.1f ms setting up x11 and "
+               "file-xfers", (now - agent->start_time) / 1000.0,
+               (connected - agent->start_time) / 1000.0,
+               (now - connected) / 1000.0);
+    }
+
     if (parent_socket != -1) {
         if (write(parent_socket, "OK", 2) != 2)
             syslog(LOG_WARNING, "Parent already gone.");
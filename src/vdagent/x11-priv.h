@@ -4,6 +4,8 @@
 #include <stdint.h>
 #include <stdio.h>
 
+#include <glib.h>
+
 #include <spice/vd_agent.h>
 
 #include <X11/extensions/Xrandr.h>
@@ -24,29 +26,108 @@
 #define MAX_SCREENS 16
 /* Same as qxl_dev.h client_monitors_config.heads count */
 #define MONITOR_SIZE_COUNT 64
+/* Large selection data is passed on to vdagentd in chunks of about this
+   size, rather than being gathered in full first */
+#define CLIPBOARD_CHUNK_SIZE (256 * 1024)
 
 enum { owner_none, owner_guest, owner_client };
 
+struct vdagent_x11;
+
+/* Gets passed the converted clipboard data, which it takes over, or NULL
+   when the conversion failed */
+typedef void (*vdagent_x11_converted_cb)(struct vdagent_x11 *x11,
+    uint8_t selection, uint32_t type, GBytes *converted);
+
+/* Decoding and encoding images can take a while, so these conversions are
+   done in a worker thread, while the request they are for waits at the
+   head of its queue */
+struct vdagent_x11_image_conversion {
+    /* Set to NULL when the request goes away before the conversion is
+       done, the result is then thrown away */
+    struct vdagent_x11 *x11;
+    uint8_t selection;
+    uint32_t from;
+    uint32_t to;
+    GBytes *data;
+    gint64 start;
+    vdagent_x11_converted_cb done;
+};
+
 /* X11 terminology is confusing a selection request is a request from an
    app to get clipboard data from us, so iow from the spice client through
-   the vdagent channel. We handle these one at a time and queue any which
-   come in while we are still handling the current one. */
+   the vdagent channel. The answers of the client only say which selection
+   they are for, so per selection we ask the client for the data of these
+   one at a time and queue any which come in while we are still waiting for
+   it. The requests of different selections are handled concurrently. */
 struct vdagent_x11_selection_request {
     XEvent event;
     uint8_t selection;
+    struct vdagent_x11_image_conversion *image_conversion;
     struct vdagent_x11_selection_request *next;
 };
 
+/* Once we have the data of a selection request which is too large to send
+   in one go, it is sent to the requestor with the INCR protocol. These
+   transfers run concurrently, each one at the pace of its requestor, so
+   that a slow requestor does not hold up the other selection requests. */
+struct vdagent_x11_incr_send {
+    struct vdagent_x11 *x11;
+    Window requestor;
+    Atom property;
+    Atom target;
+    uint8_t selection;
+    GBytes *data;
+    uint32_t pos;
+    /* Aborts the transfer when the requestor stops taking data */
+    guint timeout_id;
+    struct vdagent_x11_incr_send *next;
+};
+
+/* Seconds an INCR transfer waits for the requestor to take the next part */
+#define INCR_SEND_TIMEOUT 10
+/* Maximum number of INCR transfers to a single requestor window, further
+   requests from it are refused until one of them is done */
+#define MAX_INCR_SENDS_PER_REQUESTOR 4
+
+/* Data we got from the client is kept around, to serve repeated pastes of
+   it without asking the client again, until the client grabs or releases
+   the selection. Data converted to another type is kept the same way, until
+   the owner of the selection changes. */
+struct vdagent_x11_clipboard_cache_entry {
+    uint8_t selection;
+    uint32_t type;
+    GBytes *data;
+};
+
+/* Maximum size of the cached client clipboard data, once it is reached
+   the least recently used entries get dropped */
+#define CLIPBOARD_CACHE_MAX_SIZE (32 * 1024 * 1024)
+
 /* A conversion request is X11 speak for asking another app to give its
    clipboard data to us, we do these on behalf of the spice client to copy
-   data from the guest to the client. Like selection requests we process
-   these one at a time. */
+   data from the guest to the client. Our answers to the client only say
+   which selection they are for, and vdagentd gathers large answers per
+   selection, so like selection requests these are processed one at a time
+   per selection. The data of each selection is received in a property of
+   its own on our window, so the requests of different selections are
+   handled concurrently. */
 struct vdagent_x11_conversion_request {
+    struct vdagent_x11 *x11;
     Atom target;
+    /* The type the client asked for, this differs from the type of target
+       when the data needs to be converted */
+    uint32_t type;
     uint8_t selection;
+    /* Aborts the request when the owner of the selection stops sending */
+    guint timeout_id;
+    struct vdagent_x11_image_conversion *image_conversion;
     struct vdagent_x11_conversion_request *next;
 };
 
+/* Seconds a conversion request waits for the next part of the data */
+#define CONVERSION_TIMEOUT 10
+
 struct clipboard_format_tmpl {
     uint32_t type;
     const char *atom_names[16];
@@ -58,6 +139,58 @@ struct clipboard_format_info {
     int atom_count;
 };
 
+/* The clipboard_atom_formats hash table maps each atom of the
+   clipboard_formats to the index of its format in the upper bits, and to
+   its position in the atoms of the format, which is our preference for it
+   when several are offered, in the lower 4 bits. The value is stored + 1,
+   as a NULL value means the atom is not a clipboard format. */
+#define CLIPBOARD_ATOM_FORMAT(format, rank) \
+    GUINT_TO_POINTER((((format) << 4) | (rank)) + 1)
+
+/* The types offered by the current owner of a selection, and when the
+   guest owns it, the targets to ask the guest clipboard owner for */
+struct vdagent_x11_clipboard_types {
+    uint32_t *agent_types;
+    Atom *x11_targets;
+    int count;
+};
+
+/* The maximum number of types we accept in a grab by the client */
+#define MAX_CLIPBOARD_TYPES 256
+
+/* The selections we handle, CLIPBOARD and PRIMARY, selection numbers
+   coming from vdagentd must be checked with vdagent_x11_get_clipboard_atom
+   before being used as index */
+#define VDAGENT_X11_SELECTION_COUNT (VD_AGENT_CLIPBOARD_SELECTION_PRIMARY + 1)
+
+struct vdagent_x11_selection {
+    int owner;
+    int expected_targets_notifies;
+    struct vdagent_x11_clipboard_types types;
+    /* The selection_req which is currently being processed, and those
+       waiting for it */
+    struct vdagent_x11_selection_request *selection_req;
+    /* The conversion_req which is currently being processed, and those
+       waiting for it */
+    struct vdagent_x11_conversion_request *conversion_req;
+    int expect_property_notify;
+    /* INCR data not yet passed on to vdagentd */
+    uint8_t *clipboard_data;
+    uint32_t clipboard_data_size;
+    uint32_t clipboard_data_space;
+    uint32_t clipboard_size_hint;
+};
+
+/* Data of type to can be made, on demand, from data of type from */
+struct clipboard_conversion {
+    uint32_t to;
+    uint32_t from;
+};
+
+/* Type of ISO Latin-1 text (the STRING target), this is only used inside
+   the agent, towards the client it gets converted from / to UTF-8 */
+#define VD_AGENT_CLIPBOARD_LATIN1_TEXT 0x10000
+
 struct monitor_size {
     int width;
     int height;
@@ -65,7 +198,8 @@ struct monitor_size {
 
 static const struct clipboard_format_tmpl clipboard_format_templates[] = {
     { VD_AGENT_CLIPBOARD_UTF8_TEXT, { "UTF8_STRING", "text/plain;charset=UTF-8",
-      "text/plain;charset=utf-8", "STRING", NULL }, },
+      "text/plain;charset=utf-8", NULL }, },
+    { VD_AGENT_CLIPBOARD_LATIN1_TEXT, { "STRING", NULL }, },
     { VD_AGENT_CLIPBOARD_IMAGE_PNG, { "image/png", NULL }, },
     { VD_AGENT_CLIPBOARD_IMAGE_BMP, { "image/bmp", "image/x-bmp",
       "image/x-MS-bmp", "image/x-win-bitmap", NULL }, },
@@ -75,45 +209,59 @@ static const struct clipboard_format_tmpl clipboard_format_templates[] = {
 
 #define clipboard_format_count (sizeof(clipboard_format_templates)/sizeof(clipboard_format_templates[0]))
 
+/* Types we offer on top of those offered by the owner of a selection, when
+   one of these is requested the data gets converted from the other type */
+static const struct clipboard_conversion clipboard_conversions[] = {
+    { VD_AGENT_CLIPBOARD_UTF8_TEXT, VD_AGENT_CLIPBOARD_LATIN1_TEXT },
+    { VD_AGENT_CLIPBOARD_LATIN1_TEXT, VD_AGENT_CLIPBOARD_UTF8_TEXT },
+#ifdef HAVE_GDK_PIXBUF
+    { VD_AGENT_CLIPBOARD_IMAGE_PNG, VD_AGENT_CLIPBOARD_IMAGE_BMP },
+    { VD_AGENT_CLIPBOARD_IMAGE_PNG, VD_AGENT_CLIPBOARD_IMAGE_TIFF },
+    { VD_AGENT_CLIPBOARD_IMAGE_BMP, VD_AGENT_CLIPBOARD_IMAGE_PNG },
+#endif
+};
+
+#define clipboard_conversion_count (sizeof(clipboard_conversions)/sizeof(clipboard_conversions[0]))
+
+/* Larger clipboard data is not converted, decoding an image takes about as
+   much memory again as its BMP form */
+#define CLIPBOARD_CONVERT_MAX_SIZE (64 * 1024 * 1024)
+
+/* The fields used for every event and clipboard message come first,
+   so that they share as few cache lines as possible */
 struct vdagent_x11 {
-    struct clipboard_format_info clipboard_formats[clipboard_format_count];
     Display *display;
+    struct udscs_connection *vdagentd;
+    int debug;
+    int has_xfixes;
+    int xfixes_event_base;
+    int xrandr_event_base;
+    int max_prop_size;
+    Window selection_window;
     Atom clipboard_atom;
     Atom clipboard_primary_atom;
     Atom targets_atom;
     Atom incr_atom;
     Atom multiple_atom;
     Atom timestamp_atom;
-    Window root_window[MAX_SCREENS];
-    Window selection_window;
-    struct udscs_connection *vdagentd;
-    char *net_wm_name;
-    int debug;
+    struct vdagent_x11_selection selections[VDAGENT_X11_SELECTION_COUNT];
+    GHashTable *clipboard_atom_formats;
+    struct vdagent_x11_incr_send *incr_sends;
+    /* vdagent_x11_clipboard_cache_entry-s, most recently used first */
+    GQueue clipboard_cache;
+    size_t clipboard_cache_size;
+    struct clipboard_format_info clipboard_formats[clipboard_format_count];
+
     int fd;
     int screen_count;
+    Window root_window[MAX_SCREENS];
     int width[MAX_SCREENS];
     int height[MAX_SCREENS];
-    int has_xfixes;
-    int xfixes_event_base;
-    int xrandr_event_base;
-    int max_prop_size;
-    int expected_targets_notifies[256];
-    int clipboard_owner[256];
-    int clipboard_type_count[256];
-    uint32_t clipboard_agent_types[256][256];
-    Atom clipboard_x11_targets[256][256];
-    /* Data for conversion_req which is currently being processed */
-    struct vdagent_x11_conversion_request *conversion_req;
-    int expect_property_notify;
-    uint8_t *clipboard_data;
-    uint32_t clipboard_data_size;
-    uint32_t clipboard_data_space;
-    /* Data for selection_req which is currently being processed */
-    struct vdagent_x11_selection_request *selection_req;
-    uint8_t *selection_req_data;
-    uint32_t selection_req_data_pos;
-    uint32_t selection_req_data_size;
-    Atom selection_req_atom;
+    char *net_wm_name;
+    Atom net_supporting_wm_check_atom;
+    Atom win_supporting_wm_check_atom;
+    Atom net_wm_name_atom;
+    Atom utf8_string_atom;
     /* resolution change state */
     struct {
         XRRScreenResources *res;
@@ -41,6 +41,10 @@
 #include <X11/Xatom.h>
 #include <X11/Xlib.h>
 #include <X11/extensions/Xfixes.h>
+#ifdef HAVE_GDK_PIXBUF
+#include <gio/gio.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#endif
 #include "vdagentd-proto.h"
 #include "x11.h"
 #include "x11-priv.h"
@@ -51,15 +55,32 @@ int vdagent_x11_caught_error;
 
 static void vdagent_x11_handle_selection_notify(struct vdagent_x11 *x11,
                                                 XEvent *event, int incr);
-static void vdagent_x11_handle_selection_request(struct vdagent_x11 *x11);
+static void vdagent_x11_handle_selection_request(struct vdagent_x11 *x11,
+                                                 uint8_t selection);
+static void vdagent_x11_handle_conversion_request(struct vdagent_x11 *x11,
+                                                  uint8_t selection);
 static void vdagent_x11_handle_targets_notify(struct vdagent_x11 *x11,
                                               XEvent *event);
 static void vdagent_x11_handle_property_delete_notify(struct vdagent_x11 *x11,
                                                       XEvent *del_event);
 static void vdagent_x11_send_selection_notify(struct vdagent_x11 *x11,
-                Atom prop, struct vdagent_x11_selection_request *request);
+                Atom prop, uint8_t selection,
+                struct vdagent_x11_selection_request *request);
 static void vdagent_x11_set_clipboard_owner(struct vdagent_x11 *x11,
                                             uint8_t selection, int new_owner);
+static void vdagent_x11_incr_send_free(struct vdagent_x11_incr_send *send);
+static void vdagent_x11_image_conversion_abort(
+    struct vdagent_x11_image_conversion *conv);
+static int vdagent_x11_get_clipboard_atom(struct vdagent_x11 *x11,
+                                          uint8_t selection, Atom *clipboard);
+static void vdagent_x11_clipboard_types_set(struct vdagent_x11 *x11,
+    uint8_t selection, const uint32_t *types, const Atom *targets, int count);
+static void vdagent_x11_clipboard_cache_clear(struct vdagent_x11 *x11,
+                                              int selection);
+static GBytes *vdagent_x11_clipboard_cache_lookup(struct vdagent_x11 *x11,
+    uint8_t selection, uint32_t type);
+static void vdagent_x11_clipboard_cache_add(struct vdagent_x11 *x11,
+    uint8_t selection, uint32_t type, GBytes *data);
 
 static const char *vdagent_x11_sel_to_str(uint8_t selection) {
     switch (selection) {
@@ -128,7 +149,7 @@ static void vdagent_x11_get_wm_name(struct vdagent_x11 *x11)
 
     /* Get the window manager SUPPORTING_WM_CHECK window */
     if (XGetWindowProperty(x11->display, x11->root_window[0],
-            XInternAtom(x11->display, "_NET_SUPPORTING_WM_CHECK", False), 0,
+            x11->net_supporting_wm_check_atom, 0,
             LONG_MAX, False, XA_WINDOW, &type_ret, &format_ret, &len,
             &remain, &data) == Success) {
         if (type_ret == XA_WINDOW)
@@ -137,7 +158,7 @@ static void vdagent_x11_get_wm_name(struct vdagent_x11 *x11)
     }
     if (sup_window == None &&
         XGetWindowProperty(x11->display, x11->root_window[0],
-            XInternAtom(x11->display, "_WIN_SUPPORTING_WM_CHECK", False), 0,
+            x11->win_supporting_wm_check_atom, 0,
             LONG_MAX, False, XA_CARDINAL, &type_ret, &format_ret, &len,
             &remain, &data) == Success) {
         if (type_ret == XA_CARDINAL)
@@ -146,12 +167,11 @@ static void vdagent_x11_get_wm_name(struct vdagent_x11 *x11)
     }
     /* So that we can get the net_wm_name */
     if (sup_window != None) {
-        Atom utf8 = XInternAtom(x11->display, "UTF8_STRING", False);
         if (XGetWindowProperty(x11->display, sup_window,
-                XInternAtom(x11->display, "_NET_WM_NAME", False), 0,
-                LONG_MAX, False, utf8, &type_ret, &format_ret, &len,
-                &remain, &data) == Success) {
-            if (type_ret == utf8) {
+                x11->net_wm_name_atom, 0,
+                LONG_MAX, False, x11->utf8_string_atom, &type_ret,
+                &format_ret, &len, &remain, &data) == Success) {
+            if (type_ret == x11->utf8_string_atom) {
                 x11->net_wm_name =
                     g_strndup((char *)data, (format_ret / 8) * len);
             }
@@ -159,7 +179,7 @@ static void vdagent_x11_get_wm_name(struct vdagent_x11 *x11)
         }
         if (x11->net_wm_name == NULL &&
             XGetWindowProperty(x11->display, sup_window,
-                XInternAtom(x11->display, "_NET_WM_NAME", False), 0,
+                x11->net_wm_name_atom, 0,
                 LONG_MAX, False, XA_STRING, &type_ret, &format_ret, &len,
                 &remain, &data) == Success) {
             if (type_ret == XA_STRING) {
@@ -173,12 +193,68 @@ static void vdagent_x11_get_wm_name(struct vdagent_x11 *x11)
     vdagent_x11_restore_error_handler(x11);
 }
 
+/* Get all the atoms we need in a single roundtrip, and index those of the
+   clipboard_formats */
+static void vdagent_x11_intern_atoms(struct vdagent_x11 *x11)
+{
+    char *names[10 + clipboard_format_count * 16] = {
+        "CLIPBOARD", "PRIMARY", "TARGETS", "INCR", "MULTIPLE", "TIMESTAMP",
+        "_NET_SUPPORTING_WM_CHECK", "_WIN_SUPPORTING_WM_CHECK",
+        "_NET_WM_NAME", "UTF8_STRING",
+    };
+    Atom atoms[10 + clipboard_format_count * 16];
+    int i, j, n = 10;
+
+    for (i = 0; i < clipboard_format_count; i++) {
+        for (j = 0; clipboard_format_templates[i].atom_names[j]; j++)
+            names[n++] = (char *)clipboard_format_templates[i].atom_names[j];
+    }
+    XInternAtoms(x11->display, names, n, False, atoms);
+
+    x11->clipboard_atom = atoms[0];
+    x11->clipboard_primary_atom = atoms[1];
+    x11->targets_atom = atoms[2];
+    x11->incr_atom = atoms[3];
+    x11->multiple_atom = atoms[4];
+    x11->timestamp_atom = atoms[5];
+    x11->net_supporting_wm_check_atom = atoms[6];
+    x11->win_supporting_wm_check_atom = atoms[7];
+    x11->net_wm_name_atom = atoms[8];
+    x11->utf8_string_atom = atoms[9];
+
+    x11->clipboard_atom_formats = g_hash_table_new(NULL, NULL);
+    n = 10;
+    for (i = 0; i < clipboard_format_count; i++) {
+        x11->clipboard_formats[i].type = clipboard_format_templates[i].type;
+        for (j = 0; clipboard_format_templates[i].atom_names[j]; j++) {
+            x11->clipboard_formats[i].atoms[j] = atoms[n];
+            g_hash_table_insert(x11->clipboard_atom_formats,
+                                GUINT_TO_POINTER(atoms[n]),
+                                CLIPBOARD_ATOM_FORMAT(i, j));
+            n++;
+        }
+        x11->clipboard_formats[i].atom_count = j;
+    }
+}
+
+/* Log how long the startup phase which just ended took */
+static void vdagent_x11_trace_startup(struct vdagent_x11 *x11,
+                                      const char *phase, gint64 *phase_start)
+{
+    gint64 now = g_get_monotonic_time();
+
+    if (x11->debug)
+        syslog(LOG_DEBUG, "startup: %s took %.1f ms", phase,
+               (now - *phase_start) / 1000.0);
+    *phase_start = now;
+}
+
 struct vdagent_x11 *vdagent_x11_create(struct udscs_connection *vdagentd,
     int debug, int sync)
 {
     struct vdagent_x11 *x11;
-    XWindowAttributes attrib;
-    int i, j, major, minor;
+    int i, major, minor;
+    gint64 start = g_get_monotonic_time(), phase_start = start;
 
     x11 = calloc(1, sizeof(*x11));
     if (!x11) {
@@ -195,6 +271,7 @@ struct vdagent_x11 *vdagent_x11_create(struct udscs_connection *vdagentd,
         free(x11);
         return NULL;
     }
+    vdagent_x11_trace_startup(x11, "connecting to the X-server", &phase_start);
 
     x11->screen_count = ScreenCount(x11->display);
     if (x11->screen_count > MAX_SCREENS) {
@@ -213,22 +290,8 @@ struct vdagent_x11 *vdagent_x11_create(struct udscs_connection *vdagentd,
     for (i = 0; i < x11->screen_count; i++)
         x11->root_window[i] = RootWindow(x11->display, i);
     x11->fd = ConnectionNumber(x11->display);
-    x11->clipboard_atom = XInternAtom(x11->display, "CLIPBOARD", False);
-    x11->clipboard_primary_atom = XInternAtom(x11->display, "PRIMARY", False);
-    x11->targets_atom = XInternAtom(x11->display, "TARGETS", False);
-    x11->incr_atom = XInternAtom(x11->display, "INCR", False);
-    x11->multiple_atom = XInternAtom(x11->display, "MULTIPLE", False);
-    x11->timestamp_atom = XInternAtom(x11->display, "TIMESTAMP", False);
-    for(i = 0; i < clipboard_format_count; i++) {
-        x11->clipboard_formats[i].type = clipboard_format_templates[i].type;
-        for(j = 0; clipboard_format_templates[i].atom_names[j]; j++) {
-            x11->clipboard_formats[i].atoms[j] =
-                XInternAtom(x11->display,
-                            clipboard_format_templates[i].atom_names[j],
-                            False);
-        }
-        x11->clipboard_formats[i].atom_count = j;
-    }
+    vdagent_x11_intern_atoms(x11);
+    vdagent_x11_trace_startup(x11, "interning atoms", &phase_start);
 
     /* We should not store properties (for selections) on the root window */
     x11->selection_window = XCreateSimpleWindow(x11->display, x11->root_window[0],
@@ -237,6 +300,7 @@ struct vdagent_x11 *vdagent_x11_create(struct udscs_connection *vdagentd,
         syslog(LOG_DEBUG, "Selection window: %u", (int)x11->selection_window);
 
     vdagent_x11_randr_init(x11);
+    vdagent_x11_trace_startup(x11, "randr init", &phase_start);
 
     if (XFixesQueryExtension(x11->display, &x11->xfixes_event_base, &i) &&
         XFixesQueryVersion(x11->display, &major, &minor) && major >= 1) {
@@ -268,12 +332,15 @@ struct vdagent_x11 *vdagent_x11_create(struct udscs_connection *vdagentd,
         /* Catch resolution changes */
         XSelectInput(x11->display, x11->root_window[i], StructureNotifyMask);
 
-        /* Get the current resolution */
-        XGetWindowAttributes(x11->display, x11->root_window[i], &attrib);
-        x11->width[i]  = attrib.width;
-        x11->height[i] = attrib.height;
+        /* Get the current resolution, we've just connected so the size
+           from the connection setup is still up to date */
+        x11->width[i]  = DisplayWidth(x11->display, i);
+        x11->height[i] = DisplayHeight(x11->display, i);
     }
-    vdagent_x11_send_daemon_guest_xorg_res(x11, 1);
+    /* No need to update the randr resources, randr_init just got them */
+    vdagent_x11_send_daemon_guest_xorg_res(x11, 0);
+    vdagent_x11_trace_startup(x11, "xfixes and resolution setup",
+                              &phase_start);
 
     /* Get net_wm_name, since we are started at the same time as the wm,
        sometimes we need to wait a bit for it to show up. */
@@ -286,16 +353,21 @@ struct vdagent_x11 *vdagent_x11_create(struct udscs_connection *vdagentd,
     if (x11->debug && x11->net_wm_name)
         syslog(LOG_DEBUG, "net_wm_name: \"%s\", has icons: %d",
                x11->net_wm_name, vdagent_x11_has_icons_on_desktop(x11));
+    vdagent_x11_trace_startup(x11, "waiting for the window manager name",
+                              &phase_start);
 
     /* Flush output buffers and consume any pending events */
     vdagent_x11_do_read(x11);
+    if (x11->debug)
+        syslog(LOG_DEBUG, "startup: x11 ready after %.1f ms",
+               (g_get_monotonic_time() - start) / 1000.0);
 
     return x11;
 }
 
 void vdagent_x11_destroy(struct vdagent_x11 *x11, int vdagentd_disconnected)
 {
-    uint8_t sel;
+    int sel;
 
     if (!x11)
         return;
@@ -303,9 +375,17 @@ void vdagent_x11_destroy(struct vdagent_x11 *x11, int vdagentd_disconnected)
     if (vdagentd_disconnected)
         x11->vdagentd = NULL;
 
-    for (sel = 0; sel < VD_AGENT_CLIPBOARD_SELECTION_SECONDARY; ++sel) {
+    for (sel = 0; sel < VDAGENT_X11_SELECTION_COUNT; ++sel) {
         vdagent_x11_set_clipboard_owner(x11, sel, owner_none);
     }
+    while (x11->incr_sends)
+        vdagent_x11_incr_send_free(x11->incr_sends);
+    vdagent_x11_clipboard_cache_clear(x11, -1);
+    for (sel = 0; sel < VDAGENT_X11_SELECTION_COUNT; ++sel) {
+        vdagent_x11_clipboard_types_set(x11, sel, NULL, NULL, 0);
+        free(x11->selections[sel].clipboard_data);
+    }
+    g_hash_table_destroy(x11->clipboard_atom_formats);
 
     XCloseDisplay(x11->display);
     g_free(x11->net_wm_name);
@@ -318,97 +398,104 @@ int vdagent_x11_get_fd(struct vdagent_x11 *x11)
     return x11->fd;
 }
 
-static void vdagent_x11_next_selection_request(struct vdagent_x11 *x11)
+static void vdagent_x11_next_selection_request(struct vdagent_x11 *x11,
+                                               uint8_t selection)
 {
+    struct vdagent_x11_selection *sel = &x11->selections[selection];
     struct vdagent_x11_selection_request *selection_request;
-    selection_request = x11->selection_req;
-    x11->selection_req = selection_request->next;
+    selection_request = sel->selection_req;
+    sel->selection_req = selection_request->next;
+    vdagent_x11_image_conversion_abort(selection_request->image_conversion);
     free(selection_request);
 }
 
-static void vdagent_x11_next_conversion_request(struct vdagent_x11 *x11)
+static void vdagent_x11_next_conversion_request(struct vdagent_x11 *x11,
+                                                uint8_t selection)
 {
+    struct vdagent_x11_selection *sel = &x11->selections[selection];
     struct vdagent_x11_conversion_request *conversion_req;
-    conversion_req = x11->conversion_req;
-    x11->conversion_req = conversion_req->next;
+    Atom clip = None;
+
+    conversion_req = sel->conversion_req;
+    sel->conversion_req = conversion_req->next;
+    if (conversion_req->timeout_id)
+        g_source_remove(conversion_req->timeout_id);
+    vdagent_x11_image_conversion_abort(conversion_req->image_conversion);
     free(conversion_req);
+
+    /* Drop any INCR data of the request which was still coming in */
+    if (sel->expect_property_notify &&
+            !vdagent_x11_get_clipboard_atom(x11, selection, &clip))
+        XDeleteProperty(x11->display, x11->selection_window, clip);
+    sel->clipboard_data_size = 0;
+    sel->expect_property_notify = 0;
 }
 
 static void vdagent_x11_set_clipboard_owner(struct vdagent_x11 *x11,
     uint8_t selection, int new_owner)
 {
-    struct vdagent_x11_selection_request *prev_sel, *curr_sel, *next_sel;
-    struct vdagent_x11_conversion_request *prev_conv, *curr_conv, *next_conv;
-    int once;
+    struct vdagent_x11_selection *sel = &x11->selections[selection];
+    struct vdagent_x11_incr_send *send, *next_send;
 
     /* Clear pending requests and clipboard data */
-    once = 1;
-    prev_sel = NULL;
-    next_sel = x11->selection_req;
-    while (next_sel) {
-        curr_sel = next_sel;
-        next_sel = curr_sel->next;
-        if (curr_sel->selection == selection) {
-            if (once) {
-                SELPRINTF("selection requests pending on clipboard ownership "
-                          "change, clearing");
-                once = 0;
-            }
-            vdagent_x11_send_selection_notify(x11, None, curr_sel);
-            if (curr_sel == x11->selection_req) {
-                x11->selection_req = next_sel;
-                free(x11->selection_req_data);
-                x11->selection_req_data = NULL;
-                x11->selection_req_data_pos = 0;
-                x11->selection_req_data_size = 0;
-                x11->selection_req_atom = None;
-            } else {
-                prev_sel->next = next_sel;
-            }
-            free(curr_sel);
-        } else {
-            prev_sel = curr_sel;
+    if (sel->selection_req) {
+        SELPRINTF("selection requests pending on clipboard ownership "
+                  "change, clearing");
+        while (sel->selection_req) {
+            vdagent_x11_send_selection_notify(x11, None, selection,
+                                              sel->selection_req);
+            vdagent_x11_next_selection_request(x11, selection);
         }
     }
 
-    once = 1;
-    prev_conv = NULL;
-    next_conv = x11->conversion_req;
-    while (next_conv) {
-        curr_conv = next_conv;
-        next_conv = curr_conv->next;
-        if (curr_conv->selection == selection) {
-            if (once) {
-                SELPRINTF("client clipboard request pending on clipboard "
-                          "ownership change, clearing");
-                once = 0;
-            }
+    /* Whatever the new owner, the data we got from the client is stale */
+    vdagent_x11_clipboard_cache_clear(x11, selection);
+
+    for (send = x11->incr_sends; send; send = next_send) {
+        next_send = send->next;
+        if (send->selection == selection) {
+            SELPRINTF("incr send pending on clipboard ownership change, "
+                      "aborting");
+            vdagent_x11_incr_send_free(send);
+        }
+    }
+
+    if (sel->conversion_req) {
+        SELPRINTF("client clipboard request pending on clipboard "
+                  "ownership change, clearing");
+        while (sel->conversion_req) {
             if (x11->vdagentd)
                 udscs_write(x11->vdagentd, VDAGENTD_CLIPBOARD_DATA, selection,
                             VD_AGENT_CLIPBOARD_NONE, NULL, 0);
-            if (curr_conv == x11->conversion_req) {
-                x11->conversion_req = next_conv;
-                x11->clipboard_data_size = 0;
-                x11->expect_property_notify = 0;
-            } else {
-                prev_conv->next = next_conv;
-            }
-            free(curr_conv);
-        } else {
-            prev_conv = curr_conv;
+            vdagent_x11_next_conversion_request(x11, selection);
         }
     }
 
     if (new_owner == owner_none) {
         /* When going from owner_guest to owner_none we need to send a
            clipboard release message to the client */
-        if (x11->clipboard_owner[selection] == owner_guest && x11->vdagentd) {
+        if (sel->owner == owner_guest && x11->vdagentd) {
             udscs_write(x11->vdagentd, VDAGENTD_CLIPBOARD_RELEASE, selection,
                         0, NULL, 0);
         }
-        x11->clipboard_type_count[selection] = 0;
+        vdagent_x11_clipboard_types_set(x11, selection, NULL, NULL, 0);
     }
-    x11->clipboard_owner[selection] = new_owner;
+    sel->owner = new_owner;
+}
+
+/* Replace the types offered for selection, targets may be NULL */
+static void vdagent_x11_clipboard_types_set(struct vdagent_x11 *x11,
+    uint8_t selection, const uint32_t *types, const Atom *targets, int count)
+{
+    struct vdagent_x11_clipboard_types *t = &x11->selections[selection].types;
+
+    t->agent_types = g_renew(uint32_t, t->agent_types, count);
+    t->x11_targets = g_renew(Atom, t->x11_targets, targets ? count : 0);
+    if (count)
+        memcpy(t->agent_types, types, count * sizeof(uint32_t));
+    if (count && targets)
+        memcpy(t->x11_targets, targets, count * sizeof(Atom));
+    t->count = count;
 }
 
 static int vdagent_x11_get_clipboard_atom(struct vdagent_x11 *x11, uint8_t selection, Atom* clipboard)
@@ -499,7 +586,7 @@ static void vdagent_x11_handle_event(struct vdagent_x11 *x11, XEvent event)
         XConvertSelection(x11->display, ev.xfev.selection, x11->targets_atom,
                           x11->targets_atom, x11->selection_window,
                           CurrentTime);
-        x11->expected_targets_notifies[selection]++;
+        x11->selections[selection].expected_targets_notifies++;
         return;
     }
 
@@ -531,11 +618,10 @@ static void vdagent_x11_handle_event(struct vdagent_x11 *x11, XEvent event)
         handled = 1;
         break;
     case PropertyNotify:
-        if (x11->expect_property_notify &&
-                                event.xproperty.state == PropertyNewValue) {
+        if (event.xproperty.state == PropertyNewValue) {
             vdagent_x11_handle_selection_notify(x11, &event, 1);
         }
-        if (x11->selection_req_data &&
+        if (x11->incr_sends &&
                                  event.xproperty.state == PropertyDelete) {
             vdagent_x11_handle_property_delete_notify(x11, &event);
         }
@@ -565,16 +651,17 @@ static void vdagent_x11_handle_event(struct vdagent_x11 *x11, XEvent event)
 
         new_req->event = event;
         new_req->selection = selection;
+        new_req->image_conversion = NULL;
         new_req->next = NULL;
 
-        if (!x11->selection_req) {
-            x11->selection_req = new_req;
-            vdagent_x11_handle_selection_request(x11);
+        if (!x11->selections[selection].selection_req) {
+            x11->selections[selection].selection_req = new_req;
+            vdagent_x11_handle_selection_request(x11, selection);
             break;
         }
 
         /* maybe we should limit the selection_request stack depth ? */
-        req = x11->selection_req;
+        req = x11->selections[selection].selection_req;
         while (req->next)
             req = req->next;
 
@@ -605,14 +692,49 @@ static const char *vdagent_x11_get_atom_name(struct vdagent_x11 *x11, Atom a)
     return XGetAtomName(x11->display, a);
 }
 
+/* Make room for at least space bytes of INCR data, growing the buffer
+   geometrically so that appending chunks to it does not realloc every time */
+static int vdagent_x11_clipboard_data_reserve(struct vdagent_x11 *x11,
+                                              uint8_t selection, uint32_t space)
+{
+    struct vdagent_x11_selection *sel = &x11->selections[selection];
+    uint32_t new_space;
+    uint8_t *new_data;
+
+    if (space <= sel->clipboard_data_space)
+        return 0;
+
+    new_space = sel->clipboard_data_space ? sel->clipboard_data_space : 4096;
+    while (new_space < space && new_space <= UINT32_MAX / 2)
+        new_space *= 2;
+    if (new_space < space)
+        new_space = space;
+
+    new_data = realloc(sel->clipboard_data, new_space);
+    if (!new_data)
+        return -1;
+
+    sel->clipboard_data = new_data;
+    sel->clipboard_data_space = new_space;
+    return 0;
+}
+
+/* When chunked is set, all but the last CLIPBOARD_CHUNK_SIZE or so of large
+   selections is passed on to vdagentd in VDAGENTD_CLIPBOARD_DATA_CHUNK
+   messages as it comes in, and only the rest of it is returned. Otherwise
+   all of the data is gathered and returned. */
 static int vdagent_x11_get_selection(struct vdagent_x11 *x11, XEvent *event,
     uint8_t selection, Atom type, Atom prop, int format,
-    unsigned char **data_ret, int incr)
+    unsigned char **data_ret, int incr, int chunked)
 {
+    struct vdagent_x11_selection *sel = &x11->selections[selection];
     Bool del = incr ? True: False;
     Atom type_ret;
-    int format_ret, ret_val = -1;
-    unsigned long len, remain;
+    int format_ret, ret_val = -1, delete_prop = 0;
+    unsigned long len, remain, offset = 0, total;
+    /* Large (non INCR) properties are read a chunk at a time */
+    long max_len = (incr || format != 8 || !chunked) ?
+                   LONG_MAX : CLIPBOARD_CHUNK_SIZE / 4;
     unsigned char *data = NULL;
 
     *data_ret = NULL;
@@ -631,7 +753,7 @@ static int vdagent_x11_get_selection(struct vdagent_x11 *x11, XEvent *event,
     }
 
     if (XGetWindowProperty(x11->display, x11->selection_window, prop, 0,
-                           LONG_MAX, del, type, &type_ret, &format_ret, &len,
+                           max_len, del, type, &type_ret, &format_ret, &len,
                            &remain, &data) != Success) {
         SELPRINTF("XGetWindowProperty failed");
         goto exit;
@@ -639,32 +761,30 @@ static int vdagent_x11_get_selection(struct vdagent_x11 *x11, XEvent *event,
 
     if (!incr && prop != x11->targets_atom) {
         if (type_ret == x11->incr_atom) {
-            int prop_min_size = *(uint32_t*)data;
+            uint32_t prop_min_size = *(uint32_t*)data;
 
-            if (x11->expect_property_notify) {
+            if (sel->expect_property_notify) {
                 SELPRINTF("received an incr SelectionNotify while "
                           "still reading another incr property");
                 goto exit;
             }
 
-            if (x11->clipboard_data_space < prop_min_size) {
-                free(x11->clipboard_data);
-                x11->clipboard_data = malloc(prop_min_size);
-                if (!x11->clipboard_data) {
-                    SELPRINTF("out of memory allocating clipboard buffer");
-                    x11->clipboard_data_space = 0;
-                    goto exit;
-                }
-                x11->clipboard_data_space = prop_min_size;
+            /* When the data gets passed on a chunk at a time, there is no
+               need to make room for more than that */
+            if (vdagent_x11_clipboard_data_reserve(x11, selection, chunked ?
+                    MIN(prop_min_size, CLIPBOARD_CHUNK_SIZE) : prop_min_size)) {
+                SELPRINTF("out of memory allocating clipboard buffer");
+                goto exit;
             }
-            x11->expect_property_notify = 1;
+            sel->clipboard_size_hint = prop_min_size;
+            sel->expect_property_notify = 1;
             XSelectInput(x11->display, x11->selection_window,
                          PropertyChangeMask);
             XDeleteProperty(x11->display, x11->selection_window, prop);
             XFree(data);
             return 0; /* Wait for more data */
         }
-        XDeleteProperty(x11->display, x11->selection_window, prop);
+        delete_prop = 1;
     }
 
     if (type_ret != type) {
@@ -691,29 +811,52 @@ static int vdagent_x11_get_selection(struct vdagent_x11 *x11, XEvent *event,
         break;
     }
 
+    /* Pass on all but the last chunk of large properties as we go, so that
+       neither we nor vdagentd ever need to hold all of it in memory */
+    total = len + remain;
+    while (!incr && remain) {
+        udscs_write(x11->vdagentd, VDAGENTD_CLIPBOARD_DATA_CHUNK, selection,
+                    total, data, len);
+        VSELPRINTF("Passed on %lu bytes", len);
+        XFree(data);
+        data = NULL;
+
+        offset += len / 4;
+        if (XGetWindowProperty(x11->display, x11->selection_window, prop,
+                               offset, max_len, False, type, &type_ret,
+                               &format_ret, &len, &remain, &data) != Success ||
+                type_ret != type || format_ret != format) {
+            SELPRINTF("XGetWindowProperty failed");
+            goto exit;
+        }
+    }
+
     if (incr) {
         if (len) {
-            if (x11->clipboard_data_size + len > x11->clipboard_data_space) {
-                void *old_clipboard_data = x11->clipboard_data;
-
-                x11->clipboard_data_space = x11->clipboard_data_size + len;
-                x11->clipboard_data = realloc(x11->clipboard_data,
-                                              x11->clipboard_data_space);
-                if (!x11->clipboard_data) {
-                    SELPRINTF("out of memory allocating clipboard buffer");
-                    x11->clipboard_data_space = 0;
-                    free(old_clipboard_data);
-                    goto exit;
-                }
+            /* Pass on what we have so far, the last bit of data is always
+               kept back, it is sent together with the type once the
+               transfer is complete */
+            if (chunked && sel->clipboard_data_size &&
+                    sel->clipboard_data_size + len > CLIPBOARD_CHUNK_SIZE) {
+                udscs_write(x11->vdagentd, VDAGENTD_CLIPBOARD_DATA_CHUNK,
+                            selection, sel->clipboard_size_hint,
+                            sel->clipboard_data, sel->clipboard_data_size);
+                VSELPRINTF("Passed on %u bytes", sel->clipboard_data_size);
+                sel->clipboard_data_size = 0;
             }
-            memcpy(x11->clipboard_data + x11->clipboard_data_size, data, len);
-            x11->clipboard_data_size += len;
+            if (vdagent_x11_clipboard_data_reserve(x11, selection,
+                    sel->clipboard_data_size + len)) {
+                SELPRINTF("out of memory allocating clipboard buffer");
+                goto exit;
+            }
+            memcpy(sel->clipboard_data + sel->clipboard_data_size, data, len);
+            sel->clipboard_data_size += len;
             VSELPRINTF("Appended %ld bytes to buffer", len);
             XFree(data);
             return 0; /* Wait for more data */
         }
-        len = x11->clipboard_data_size;
-        *data_ret = x11->clipboard_data;
+        len = sel->clipboard_data_size;
+        *data_ret = sel->clipboard_data;
     } else
         *data_ret = data;
 
@@ -728,40 +871,85 @@ exit:
     if ((incr || ret_val == -1) && data)
         XFree(data);
 
+    if (delete_prop)
+        XDeleteProperty(x11->display, x11->selection_window, prop);
+
     if (incr) {
-        x11->clipboard_data_size = 0;
-        x11->expect_property_notify = 0;
+        sel->clipboard_data_size = 0;
+        sel->expect_property_notify = 0;
     }
 
     return ret_val;
 }
 
 static void vdagent_x11_get_selection_free(struct vdagent_x11 *x11,
-    unsigned char *data, int incr)
+    uint8_t selection, unsigned char *data, int incr)
 {
+    struct vdagent_x11_selection *sel = &x11->selections[selection];
+
     if (incr) {
         /* If the clipboard has grown large return the memory to the system */
-        if (x11->clipboard_data_space > 512 * 1024) {
-            free(x11->clipboard_data);
-            x11->clipboard_data = NULL;
-            x11->clipboard_data_space = 0;
+        if (sel->clipboard_data_space > 512 * 1024) {
+            free(sel->clipboard_data);
+            sel->clipboard_data = NULL;
+            sel->clipboard_data_space = 0;
         }
     } else if (data)
         XFree(data);
 }
 
+static void vdagent_x11_xfree(gpointer data)
+{
+    XFree(data);
+}
+
+/* Like vdagent_x11_get_selection_free, but instead of freeing the data,
+   wrap it in a GBytes which takes over ownership of it where possible, so
+   that it can be queued for sending without copying it. */
+static GBytes *vdagent_x11_get_selection_bytes(struct vdagent_x11 *x11,
+    uint8_t selection, unsigned char *data, int len, int incr)
+{
+    struct vdagent_x11_selection *sel = &x11->selections[selection];
+    GBytes *bytes;
+
+    if (!incr)
+        return g_bytes_new_with_free_func(data, len, vdagent_x11_xfree, data);
+
+    /* Keep small INCR buffers around for re-use by the next transfer */
+    if (sel->clipboard_data_space <= 512 * 1024)
+        return g_bytes_new(data, len);
+
+    bytes = g_bytes_new_take(sel->clipboard_data, len);
+    sel->clipboard_data = NULL;
+    sel->clipboard_data_space = 0;
+    return bytes;
+}
+
+/* Returns the index of the clipboard_formats entry atom belongs to, and its
+   preference rank within it, or -1 if it is not a clipboard format */
+static int vdagent_x11_atom_to_format(struct vdagent_x11 *x11, Atom atom,
+                                      int *rank)
+{
+    guint value;
+
+    value = GPOINTER_TO_UINT(g_hash_table_lookup(x11->clipboard_atom_formats,
+                                                 GUINT_TO_POINTER(atom)));
+    if (!value)
+        return -1;
+
+    value--;
+    if (rank)
+        *rank = value & 0xf;
+    return value >> 4;
+}
+
 static uint32_t vdagent_x11_target_to_type(struct vdagent_x11 *x11,
     uint8_t selection, Atom target)
 {
-    int i, j;
+    int format = vdagent_x11_atom_to_format(x11, target, NULL);
 
-    for (i = 0; i < clipboard_format_count; i++) {
-        for (j = 0; j < x11->clipboard_formats[i].atom_count; j++) {
-            if (x11->clipboard_formats[i].atoms[j] == target) {
-                return x11->clipboard_formats[i].type;
-            }
-        }
-    }
+    if (format != -1)
+        return x11->clipboard_formats[format].type;
 
     VSELPRINTF("unexpected selection type %s",
                vdagent_x11_get_atom_name(x11, target));
@@ -771,28 +959,317 @@ static uint32_t vdagent_x11_target_to_type(struct vdagent_x11 *x11,
 static Atom vdagent_x11_type_to_target(struct vdagent_x11 *x11,
                                        uint8_t selection, uint32_t type)
 {
+    struct vdagent_x11_clipboard_types *t = &x11->selections[selection].types;
     int i;
 
-    for (i = 0; i < x11->clipboard_type_count[selection]; i++) {
-        if (x11->clipboard_agent_types[selection][i] == type) {
-            return x11->clipboard_x11_targets[selection][i];
+    for (i = 0; i < t->count; i++) {
+        if (t->agent_types[i] == type && t->x11_targets) {
+            return t->x11_targets[i];
         }
     }
     SELPRINTF("client requested unavailable type %u", type);
     return None;
 }
 
-static void vdagent_x11_handle_conversion_request(struct vdagent_x11 *x11)
+/* Returns the type of the data offered by the client (we own the selection
+   on its behalf) which type can be served from, either type itself or a
+   type it can be converted from, or VD_AGENT_CLIPBOARD_NONE */
+static uint32_t vdagent_x11_clipboard_source_type(struct vdagent_x11 *x11,
+    uint8_t selection, uint32_t type)
+{
+    struct vdagent_x11_clipboard_types *t = &x11->selections[selection].types;
+    int i, j;
+
+    for (i = 0; i < t->count; i++) {
+        if (t->agent_types[i] == type)
+            return type;
+    }
+    for (j = 0; j < clipboard_conversion_count; j++) {
+        if (clipboard_conversions[j].to != type)
+            continue;
+        for (i = 0; i < t->count; i++) {
+            if (t->agent_types[i] == clipboard_conversions[j].from)
+                return clipboard_conversions[j].from;
+        }
+    }
+    return VD_AGENT_CLIPBOARD_NONE;
+}
+
+/* Log the outcome of converting size bytes of clipboard data, which was
+   started at start */
+static void vdagent_x11_conversion_log(struct vdagent_x11 *x11,
+    uint8_t selection, uint32_t from, uint32_t to, gsize size, gint64 start,
+    GBytes *converted, GError *err)
+{
+    if (!converted) {
+        SELPRINTF("converting clipboard data from type %u to %u failed: %s",
+                  from, to, err ? err->message : "unknown error");
+        return;
+    }
+
+    VSELPRINTF("converted %u bytes of type %u to %u bytes of type %u in "
+               "%.1f ms", (unsigned int)size, from,
+               (unsigned int)g_bytes_get_size(converted), to,
+               (g_get_monotonic_time() - start) / 1000.0);
+}
+
+#ifdef HAVE_GDK_PIXBUF
+static GBytes *vdagent_x11_convert_image(const uint8_t *data, gsize size,
+    const char *format, GError **err)
+{
+    GdkPixbufLoader *loader;
+    GdkPixbuf *pixbuf;
+    gchar *buf = NULL;
+    gsize len;
+
+    loader = gdk_pixbuf_loader_new();
+    if (gdk_pixbuf_loader_write(loader, data, size, err) &&
+            gdk_pixbuf_loader_close(loader, err)) {
+        pixbuf = gdk_pixbuf_loader_get_pixbuf(loader);
+        if (!gdk_pixbuf_save_to_buffer(pixbuf, &buf, &len, format, err, NULL))
+            buf = NULL;
+    } else {
+        gdk_pixbuf_loader_close(loader, NULL);
+    }
+    g_object_unref(loader);
+
+    return buf ? g_bytes_new_take(buf, len) : NULL;
+}
+
+/* Runs in a worker thread, so it must not touch conv->x11 */
+static void vdagent_x11_image_conversion_run(GTask *task,
+    gpointer source_object, gpointer task_data, GCancellable *cancellable)
+{
+    struct vdagent_x11_image_conversion *conv = task_data;
+    GError *err = NULL;
+    GBytes *converted;
+    gsize size;
+    const uint8_t *data = g_bytes_get_data(conv->data, &size);
+
+    converted = vdagent_x11_convert_image(data, size,
+        conv->to == VD_AGENT_CLIPBOARD_IMAGE_PNG ? "png" : "bmp", &err);
+    if (converted)
+        g_task_return_pointer(task, converted,
+                              (GDestroyNotify)g_bytes_unref);
+    else
+        g_task_return_error(task, err);
+}
+
+static void vdagent_x11_image_conversion_done(GObject *source_object,
+    GAsyncResult *result, gpointer user_data)
 {
+    struct vdagent_x11_image_conversion *conv = user_data;
+    struct vdagent_x11 *x11 = conv->x11;
+    uint8_t selection = conv->selection;
+    GError *err = NULL;
+    GBytes *converted;
+
+    converted = g_task_propagate_pointer(G_TASK(result), &err);
+    if (x11) {
+        vdagent_x11_conversion_log(x11, selection, conv->from, conv->to,
+                                   g_bytes_get_size(conv->data), conv->start,
+                                   converted, err);
+        conv->done(x11, selection, conv->to, converted);
+        /* Flush output buffers and consume any pending events */
+        vdagent_x11_do_read(x11);
+    } else if (converted) {
+        g_bytes_unref(converted);
+    }
+    g_clear_error(&err);
+    g_bytes_unref(conv->data);
+    free(conv);
+}
+#endif
+
+/* Throw away the result of an image conversion which is still running */
+static void vdagent_x11_image_conversion_abort(
+    struct vdagent_x11_image_conversion *conv)
+{
+    if (conv)
+        conv->x11 = NULL;
+}
+
+/* Convert clipboard data of type from to type to, for one of the
+   clipboard_conversions, and pass the result to done. Text is converted
+   right away. Images are converted in a worker thread and done gets called
+   from the main loop once that finishes, until then the conversion is
+   stored in *conversion, so that it can be aborted. */
+static void vdagent_x11_convert_clipboard_data(struct vdagent_x11 *x11,
+    uint8_t selection, uint32_t from, uint32_t to, GBytes *bytes,
+    struct vdagent_x11_image_conversion **conversion,
+    vdagent_x11_converted_cb done)
+{
+    GBytes *converted = NULL;
+    GError *err = NULL;
+    gsize size, len;
+    const uint8_t *data = g_bytes_get_data(bytes, &size);
+    gint64 start = g_get_monotonic_time();
+    gchar *buf;
+
+    if (size > CLIPBOARD_CONVERT_MAX_SIZE) {
+        SELPRINTF("not converting %u bytes of type %u to %u, the maximum is "
+                  "%u bytes", (unsigned int)size, from, to,
+                  CLIPBOARD_CONVERT_MAX_SIZE);
+        done(x11, selection, to, NULL);
+        return;
+    }
+
+    if (from == VD_AGENT_CLIPBOARD_LATIN1_TEXT &&
+            to == VD_AGENT_CLIPBOARD_UTF8_TEXT) {
+        buf = g_convert((const gchar *)data, size, "UTF-8", "ISO-8859-1",
+                        NULL, &len, &err);
+        if (buf)
+            converted = g_bytes_new_take(buf, len);
+    } else if (from == VD_AGENT_CLIPBOARD_UTF8_TEXT &&
+            to == VD_AGENT_CLIPBOARD_LATIN1_TEXT) {
+        buf = g_convert_with_fallback((const gchar *)data, size, "ISO-8859-1",
+                                      "UTF-8", "?", NULL, &len, &err);
+        if (buf)
+            converted = g_bytes_new_take(buf, len);
+#ifdef HAVE_GDK_PIXBUF
+    } else if (to == VD_AGENT_CLIPBOARD_IMAGE_PNG ||
+               to == VD_AGENT_CLIPBOARD_IMAGE_BMP) {
+        struct vdagent_x11_image_conversion *conv;
+        GTask *task;
+
+        conv = calloc(1, sizeof(*conv));
+        if (!conv) {
+            SELPRINTF("out of memory allocating image conversion");
+            done(x11, selection, to, NULL);
+            return;
+        }
+        conv->x11 = x11;
+        conv->selection = selection;
+        conv->from = from;
+        conv->to = to;
+        conv->data = g_bytes_ref(bytes);
+        conv->start = start;
+        conv->done = done;
+        *conversion = conv;
+
+        task = g_task_new(NULL, NULL, vdagent_x11_image_conversion_done, conv);
+        g_task_set_task_data(task, conv, NULL);
+        g_task_run_in_thread(task, vdagent_x11_image_conversion_run);
+        g_object_unref(task);
+        return;
+#endif
+    } else {
+        SELPRINTF("no conversion from type %u to %u", from, to);
+        done(x11, selection, to, NULL);
+        return;
+    }
+
+    vdagent_x11_conversion_log(x11, selection, from, to, size, start,
+                               converted, err);
+    g_clear_error(&err);
+    done(x11, selection, to, converted);
+}
+
+/* Send the data of selection to vdagentd, large data is split into
+   VDAGENTD_CLIPBOARD_DATA_CHUNK messages, like when it gets passed on as it
+   comes in. The parts reference bytes, so this does not copy the data. */
+static void vdagent_x11_send_selection_bytes(struct vdagent_x11 *x11,
+    uint8_t selection, uint32_t type, GBytes *bytes)
+{
+    gsize size = g_bytes_get_size(bytes), offset = 0;
+    GBytes *part;
+
+    for (; size - offset > CLIPBOARD_CHUNK_SIZE;
+           offset += CLIPBOARD_CHUNK_SIZE) {
+        part = g_bytes_new_from_bytes(bytes, offset, CLIPBOARD_CHUNK_SIZE);
+        udscs_write_bytes(x11->vdagentd, VDAGENTD_CLIPBOARD_DATA_CHUNK,
+                          selection, size, part);
+        g_bytes_unref(part);
+    }
+
+    if (offset == 0) {
+        udscs_write_bytes(x11->vdagentd, VDAGENTD_CLIPBOARD_DATA, selection,
+                          type, bytes);
+        return;
+    }
+    part = g_bytes_new_from_bytes(bytes, offset, size - offset);
+    udscs_write_bytes(x11->vdagentd, VDAGENTD_CLIPBOARD_DATA, selection,
+                      type, part);
+    g_bytes_unref(part);
+}
+
+static gboolean vdagent_x11_conversion_timeout(gpointer user_data)
+{
+    struct vdagent_x11_conversion_request *req = user_data;
+    struct vdagent_x11 *x11 = req->x11;
+    uint8_t selection = req->selection;
+
+    SELPRINTF("clipboard owner did not send the %s data, aborting",
+              vdagent_x11_get_atom_name(x11, req->target));
+    req->timeout_id = 0;
+    udscs_write(x11->vdagentd, VDAGENTD_CLIPBOARD_DATA, selection,
+                VD_AGENT_CLIPBOARD_NONE, NULL, 0);
+    vdagent_x11_next_conversion_request(x11, selection);
+    vdagent_x11_handle_conversion_request(x11, selection);
+    /* Flush output buffers and consume any pending events */
+    vdagent_x11_do_read(x11);
+    return G_SOURCE_REMOVE;
+}
+
+/* (Re)start the timeout for the owner of the selection to send the next
+   part of the data */
+static void vdagent_x11_conversion_touch(
+    struct vdagent_x11_conversion_request *req)
+{
+    if (req->timeout_id)
+        g_source_remove(req->timeout_id);
+    req->timeout_id = g_timeout_add_seconds(CONVERSION_TIMEOUT,
+                                            vdagent_x11_conversion_timeout,
+                                            req);
+}
+
+static void vdagent_x11_handle_conversion_request(struct vdagent_x11 *x11,
+                                                  uint8_t selection)
+{
+    struct vdagent_x11_conversion_request *req =
+        x11->selections[selection].conversion_req;
     Atom clip = None;
 
-    if (!x11->conversion_req) {
+    if (!req) {
         return;
     }
 
-    vdagent_x11_get_clipboard_atom(x11, x11->conversion_req->selection, &clip);
-    XConvertSelection(x11->display, clip, x11->conversion_req->target,
+    /* The data is received in the property named after the selection, so
+       that the requests of different selections do not get in each
+       other's way */
+    vdagent_x11_get_clipboard_atom(x11, selection, &clip);
+    XConvertSelection(x11->display, clip, req->target,
                       clip, x11->selection_window, CurrentTime);
+    vdagent_x11_conversion_touch(req);
+}
+
+/* Answer the conversion_req of selection being processed with the
+   converted data, and move on to the next one */
+static void vdagent_x11_conversion_request_converted(struct vdagent_x11 *x11,
+    uint8_t selection, uint32_t type, GBytes *converted)
+{
+    if (converted) {
+        /* Until the owner changes, later requests are served from it */
+        vdagent_x11_clipboard_cache_add(x11, selection, type, converted);
+        vdagent_x11_send_selection_bytes(x11, selection, type, converted);
+        g_bytes_unref(converted);
+    } else {
+        udscs_write(x11->vdagentd, VDAGENTD_CLIPBOARD_DATA, selection,
+                    VD_AGENT_CLIPBOARD_NONE, NULL, 0);
+    }
+
+    vdagent_x11_next_conversion_request(x11, selection);
+    vdagent_x11_handle_conversion_request(x11, selection);
+}
+
+/* Returns the selection whose data is received in prop, or -1 */
+static int vdagent_x11_property_selection(struct vdagent_x11 *x11, Atom prop)
+{
+    if (prop == x11->clipboard_atom)
+        return VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD;
+    if (prop == x11->clipboard_primary_atom)
+        return VD_AGENT_CLIPBOARD_SELECTION_PRIMARY;
+    return -1;
 }
 
 static void vdagent_x11_handle_selection_notify(struct vdagent_x11 *x11,
@@ -800,49 +1277,61 @@ static void vdagent_x11_handle_selection_notify(struct vdagent_x11 *x11,
 {
     int len = 0;
     unsigned char *data = NULL;
-    uint32_t type;
+    uint32_t type, target_type;
     uint8_t selection = -1;
+    struct vdagent_x11_conversion_request *req;
     Atom clip = None;
 
-    if (!x11->conversion_req) {
-        syslog(LOG_ERR, "SelectionNotify received without a target");
-        return;
-    }
-    vdagent_x11_get_clipboard_atom(x11, x11->conversion_req->selection, &clip);
-
     if (incr) {
-        if (event->xproperty.atom != clip ||
-                event->xproperty.window != x11->selection_window) {
+        int prop_selection;
+
+        if (event->xproperty.window != x11->selection_window) {
             return;
         }
-    } else {
-        if (vdagent_x11_get_clipboard_selection(x11, event, &selection)) {
-            len = -1;
-        } else if (selection != x11->conversion_req->selection) {
-            SELPRINTF("Requested data for selection %d got %d",
-                      (int)x11->conversion_req->selection, (int)selection);
-            len = -1;
-        }
-        if (event->xselection.target != x11->conversion_req->target &&
-                event->xselection.target != x11->incr_atom) {
-            SELPRINTF("Requested %s target got %s",
-                vdagent_x11_get_atom_name(x11, x11->conversion_req->target),
-                vdagent_x11_get_atom_name(x11, event->xselection.target));
-            len = -1;
+        prop_selection = vdagent_x11_property_selection(x11,
+                                                        event->xproperty.atom);
+        if (prop_selection == -1 ||
+                !x11->selections[prop_selection].expect_property_notify) {
+            return;
         }
+        selection = prop_selection;
+    } else if (vdagent_x11_get_clipboard_selection(x11, event, &selection)) {
+        return;
     }
 
-    selection = x11->conversion_req->selection;
-    type = vdagent_x11_target_to_type(x11, selection,
-                                      x11->conversion_req->target);
-    if (type == VD_AGENT_CLIPBOARD_NONE)
+    req = x11->selections[selection].conversion_req;
+    if (!req) {
+        SELPRINTF("SelectionNotify received without a target");
+        return;
+    }
+    if (req->image_conversion) {
+        SELPRINTF("SelectionNotify received while converting the data, "
+                  "ignoring");
+        return;
+    }
+    vdagent_x11_get_clipboard_atom(x11, selection, &clip);
+
+    if (!incr && event->xselection.target != req->target &&
+            event->xselection.target != x11->incr_atom) {
+        SELPRINTF("Requested %s target got %s",
+            vdagent_x11_get_atom_name(x11, req->target),
+            vdagent_x11_get_atom_name(x11, event->xselection.target));
+        len = -1;
+    }
+
+    type = req->type;
+    target_type = vdagent_x11_target_to_type(x11, selection, req->target);
+    if (target_type == VD_AGENT_CLIPBOARD_NONE)
         SELPRINTF("internal error conversion_req has bad target %s",
-                  vdagent_x11_get_atom_name(x11, x11->conversion_req->target));
+                  vdagent_x11_get_atom_name(x11, req->target));
     if (len == 0) { /* No errors so far */
-        len = vdagent_x11_get_selection(x11, event, selection,
-                                        x11->conversion_req->target,
-                                        clip, 8, &data, incr);
+        /* Data which needs converting is only passed on once all of it
+           has been converted, so it must not be passed on as it comes in */
+        len = vdagent_x11_get_selection(x11, event, selection, req->target,
+                                        clip, 8, &data, incr,
+                                        target_type == type);
         if (len == 0) { /* waiting for more data? */
+            vdagent_x11_conversion_touch(req);
             return;
         }
     }
@@ -851,24 +1340,32 @@ static void vdagent_x11_handle_selection_notify(struct vdagent_x11 *x11,
         len = 0;
     }
 
-    udscs_write(x11->vdagentd, VDAGENTD_CLIPBOARD_DATA, selection, type,
-                data, len);
-    vdagent_x11_get_selection_free(x11, data, incr);
-
-    vdagent_x11_next_conversion_request(x11);
-    vdagent_x11_handle_conversion_request(x11);
-}
-
-static Atom atom_lists_overlap(Atom *atoms1, Atom *atoms2, int l1, int l2)
-{
-    int i, j;
-
-    for (i = 0; i < l1; i++)
-        for (j = 0; j < l2; j++)
-            if (atoms1[i] == atoms2[j])
-                return atoms1[i];
+    if (len > 0) {
+        GBytes *bytes = vdagent_x11_get_selection_bytes(x11, selection,
+                                                        data, len, incr);
+
+        if (target_type != type) {
+            /* All data is in, the conversion may take longer than the
+               owner of the selection is given to send it */
+            if (req->timeout_id)
+                g_source_remove(req->timeout_id);
+            req->timeout_id = 0;
+            vdagent_x11_convert_clipboard_data(x11, selection, target_type,
+                type, bytes, &req->image_conversion,
+                vdagent_x11_conversion_request_converted);
+            g_bytes_unref(bytes);
+            return;
+        }
+        vdagent_x11_send_selection_bytes(x11, selection, type, bytes);
+        g_bytes_unref(bytes);
+    } else {
+        udscs_write(x11->vdagentd, VDAGENTD_CLIPBOARD_DATA, selection, type,
+                    data, len);
+        vdagent_x11_get_selection_free(x11, selection, data, incr);
+    }
 
-    return 0;
+    vdagent_x11_next_conversion_request(x11, selection);
+    vdagent_x11_handle_conversion_request(x11, selection);
 }
 
 static void vdagent_x11_print_targets(struct vdagent_x11 *x11,
@@ -883,32 +1380,37 @@ static void vdagent_x11_print_targets(struct vdagent_x11 *x11,
 static void vdagent_x11_handle_targets_notify(struct vdagent_x11 *x11,
                                               XEvent *event)
 {
-    int i, len;
-    Atom atom, *atoms = NULL;
+    int i, j, len, format, rank, native_count = 0, type_count = 0;
+    Atom *atoms = NULL;
     uint8_t selection;
-    int *type_count;
+    Atom best_targets[clipboard_format_count];
+    int best_ranks[clipboard_format_count];
+    uint32_t native_types[clipboard_format_count];
+    Atom native_targets[clipboard_format_count];
+    uint32_t types[clipboard_format_count + clipboard_conversion_count];
+    Atom targets[clipboard_format_count + clipboard_conversion_count];
 
     if (vdagent_x11_get_clipboard_selection(x11, event, &selection)) {
         return;
     }
 
-    if (!x11->expected_targets_notifies[selection]) {
+    if (!x11->selections[selection].expected_targets_notifies) {
         SELPRINTF("unexpected selection notify TARGETS");
         return;
     }
 
-    x11->expected_targets_notifies[selection]--;
+    x11->selections[selection].expected_targets_notifies--;
 
     /* If we have more targets_notifies pending, ignore this one, we
        are only interested in the targets list of the current owner
        (which is the last one we've requested a targets list from) */
-    if (x11->expected_targets_notifies[selection]) {
+    if (x11->selections[selection].expected_targets_notifies) {
         return;
     }
 
     len = vdagent_x11_get_selection(x11, event, selection,
                                     XA_ATOM, x11->targets_atom, 32,
-                                    (unsigned char **)&atoms, 0);
+                                    (unsigned char **)&atoms, 0, 0);
     if (len == 0 || len == -1) /* waiting for more data or error? */
         return;
 
@@ -916,43 +1418,77 @@ static void vdagent_x11_handle_targets_notify(struct vdagent_x11 *x11,
     len /= sizeof(Atom);
     vdagent_x11_print_targets(x11, selection, "received", atoms, len);
 
-    type_count = &x11->clipboard_type_count[selection];
-    *type_count = 0;
+    /* For each format pick the offered target we like best */
+    for (i = 0; i < clipboard_format_count; i++)
+        best_targets[i] = None;
+    for (i = 0; i < len; i++) {
+        format = vdagent_x11_atom_to_format(x11, atoms[i], &rank);
+        if (format == -1)
+            continue;
+        if (best_targets[format] == None || rank < best_ranks[format]) {
+            best_targets[format] = atoms[i];
+            best_ranks[format] = rank;
+        }
+    }
     for (i = 0; i < clipboard_format_count; i++) {
-        atom = atom_lists_overlap(x11->clipboard_formats[i].atoms, atoms,
-                                  x11->clipboard_formats[i].atom_count, len);
-        if (atom) {
-            x11->clipboard_agent_types[selection][*type_count] =
-                x11->clipboard_formats[i].type;
-            x11->clipboard_x11_targets[selection][*type_count] = atom;
-            (*type_count)++;
-            if (*type_count ==
-                    sizeof(x11->clipboard_agent_types[0])/sizeof(uint32_t)) {
-                SELPRINTF("handle_targets_notify: too many types");
+        if (best_targets[i] != None) {
+            native_types[native_count] = x11->clipboard_formats[i].type;
+            native_targets[native_count] = best_targets[i];
+            native_count++;
+        }
+    }
+
+    /* Offer the client the types we have, minus those only used inside
+       the agent, plus those we can convert to on demand */
+    for (i = 0; i < native_count; i++) {
+        if (native_types[i] == VD_AGENT_CLIPBOARD_LATIN1_TEXT)
+            continue;
+        types[type_count] = native_types[i];
+        targets[type_count] = native_targets[i];
+        type_count++;
+    }
+    for (j = 0; j < clipboard_conversion_count; j++) {
+        if (clipboard_conversions[j].to == VD_AGENT_CLIPBOARD_LATIN1_TEXT)
+            continue;
+        for (i = 0; i < type_count; i++) {
+            if (types[i] == clipboard_conversions[j].to)
+                break;
+        }
+        if (i < type_count)
+            continue;
+        for (i = 0; i < native_count; i++) {
+            if (native_types[i] == clipboard_conversions[j].from) {
+                types[type_count] = clipboard_conversions[j].to;
+                targets[type_count] = native_targets[i];
+                type_count++;
                 break;
             }
         }
     }
 
-    if (*type_count) {
+    vdagent_x11_clipboard_types_set(x11, selection, types, targets,
+                                    type_count);
+    if (type_count) {
         udscs_write(x11->vdagentd, VDAGENTD_CLIPBOARD_GRAB, selection, 0,
-                    (uint8_t *)x11->clipboard_agent_types[selection],
-                    *type_count * sizeof(uint32_t));
+                    (uint8_t *)types, type_count * sizeof(uint32_t));
         vdagent_x11_set_clipboard_owner(x11, selection, owner_guest);
     }
 
-    vdagent_x11_get_selection_free(x11, (unsigned char *)atoms, 0);
+    vdagent_x11_get_selection_free(x11, selection, (unsigned char *)atoms, 0);
 }
 
+/* Answer request, or when it is NULL the selection_req of selection being
+   processed, after which the next one queued for selection is handled */
 static void vdagent_x11_send_selection_notify(struct vdagent_x11 *x11,
-    Atom prop, struct vdagent_x11_selection_request *request)
+    Atom prop, uint8_t selection,
+    struct vdagent_x11_selection_request *request)
 {
     XEvent res, *event;
 
     if (request) {
         event = &request->event;
     } else {
-        event = &x11->selection_req->event;
+        event = &x11->selections[selection].selection_req->event;
     }
 
     res.xselection.property = prop;
@@ -968,8 +1504,8 @@ static void vdagent_x11_send_selection_notify(struct vdagent_x11 *x11,
     vdagent_x11_restore_error_handler(x11);
 
     if (!request) {
-        vdagent_x11_next_selection_request(x11);
-        vdagent_x11_handle_selection_request(x11);
+        vdagent_x11_next_selection_request(x11, selection);
+        vdagent_x11_handle_selection_request(x11, selection);
     }
 }
 
@@ -978,11 +1514,12 @@ static void vdagent_x11_send_targets(struct vdagent_x11 *x11,
 {
     Atom prop, targets[256] = { x11->targets_atom, };
     int i, j, k, target_count = 1;
+    uint32_t type, source_type;
 
-    for (i = 0; i < x11->clipboard_type_count[selection]; i++) {
+    for (i = 0; i < x11->selections[selection].types.count; i++) {
         for (j = 0; j < clipboard_format_count; j++) {
             if (x11->clipboard_formats[j].type !=
-                    x11->clipboard_agent_types[selection][i])
+                    x11->selections[selection].types.agent_types[i])
                 continue;
 
             for (k = 0; k < x11->clipboard_formats[j].atom_count; k++) {
@@ -995,6 +1532,22 @@ static void vdagent_x11_send_targets(struct vdagent_x11 *x11,
             }
         }
     }
+    /* And the targets we can convert the client's data to */
+    for (j = 0; j < clipboard_format_count; j++) {
+        type = x11->clipboard_formats[j].type;
+        source_type = vdagent_x11_clipboard_source_type(x11, selection, type);
+        if (source_type == type || source_type == VD_AGENT_CLIPBOARD_NONE)
+            continue;
+
+        for (k = 0; k < x11->clipboard_formats[j].atom_count; k++) {
+            targets[target_count] = x11->clipboard_formats[j].atoms[k];
+            target_count++;
+            if (target_count == sizeof(targets)/sizeof(Atom)) {
+                SELPRINTF("send_targets: too many targets");
+                goto exit_loop;
+            }
+        }
+    }
 exit_loop:
 
     prop = event->xselectionrequest.property;
@@ -1008,34 +1561,245 @@ exit_loop:
     if (vdagent_x11_restore_error_handler(x11) == 0) {
         vdagent_x11_print_targets(x11, selection, "sent",
                                   targets, target_count);
-        vdagent_x11_send_selection_notify(x11, prop, NULL);
+        vdagent_x11_send_selection_notify(x11, prop, selection, NULL);
     } else
         SELPRINTF("send_targets: Failed to sent, requestor window gone");
 }
 
-static void vdagent_x11_handle_selection_request(struct vdagent_x11 *x11)
+static void vdagent_x11_incr_send_free(struct vdagent_x11_incr_send *send)
+{
+    struct vdagent_x11 *x11 = send->x11;
+    struct vdagent_x11_incr_send **sendp;
+
+    for (sendp = &x11->incr_sends; *sendp; sendp = &(*sendp)->next) {
+        if (*sendp == send) {
+            *sendp = send->next;
+            break;
+        }
+    }
+
+    if (send->timeout_id)
+        g_source_remove(send->timeout_id);
+    g_bytes_unref(send->data);
+    free(send);
+}
+
+static gboolean vdagent_x11_incr_send_timeout(gpointer user_data)
+{
+    struct vdagent_x11_incr_send *send = user_data;
+    uint8_t selection = send->selection;
+
+    SELPRINTF("incr send to requestor 0x%lx timed out, aborting",
+              send->requestor);
+    send->timeout_id = 0;
+    vdagent_x11_incr_send_free(send);
+    return G_SOURCE_REMOVE;
+}
+
+/* (Re)start the timeout for the requestor to take the next part */
+static void vdagent_x11_incr_send_touch(struct vdagent_x11_incr_send *send)
+{
+    if (send->timeout_id)
+        g_source_remove(send->timeout_id);
+    send->timeout_id = g_timeout_add_seconds(INCR_SEND_TIMEOUT,
+                                             vdagent_x11_incr_send_timeout,
+                                             send);
+}
+
+static int vdagent_x11_incr_send_count(struct vdagent_x11 *x11,
+                                       Window requestor)
+{
+    struct vdagent_x11_incr_send *send;
+    int count = 0;
+
+    for (send = x11->incr_sends; send; send = send->next) {
+        if (send->requestor == requestor)
+            count++;
+    }
+    return count;
+}
+
+/* Send data to the requestor of the selection_req of selection being
+   processed */
+static void vdagent_x11_send_clipboard_data(struct vdagent_x11 *x11,
+                                            uint8_t selection, GBytes *bytes)
+{
+    XEvent *event = &x11->selections[selection].selection_req->event;
+    struct vdagent_x11_incr_send *send;
+    gsize size;
+    const uint8_t *data = g_bytes_get_data(bytes, &size);
+    Atom prop;
+
+    prop = event->xselectionrequest.property;
+    if (prop == None)
+        prop = event->xselectionrequest.target;
+
+    if (size > x11->max_prop_size) {
+        unsigned long len = size;
+        VSELPRINTF("Starting incr send of clipboard data");
+
+        send = calloc(1, sizeof(*send));
+        if (!send) {
+            SELPRINTF("out of memory allocating incr send");
+            vdagent_x11_send_selection_notify(x11, None, selection, NULL);
+            return;
+        }
+        send->x11 = x11;
+        send->requestor = event->xselectionrequest.requestor;
+        send->property = prop;
+        send->target = event->xselectionrequest.target;
+        send->selection = selection;
+        send->data = g_bytes_ref(bytes);
+
+        vdagent_x11_set_error_handler(x11, vdagent_x11_ignore_bad_window_handler);
+        XSelectInput(x11->display, event->xselectionrequest.requestor,
+                     PropertyChangeMask);
+        XChangeProperty(x11->display, event->xselectionrequest.requestor, prop,
+                        x11->incr_atom, 32, PropModeReplace,
+                        (unsigned char*)&len, 1);
+        if (vdagent_x11_restore_error_handler(x11) == 0) {
+            send->next = x11->incr_sends;
+            x11->incr_sends = send;
+            vdagent_x11_incr_send_touch(send);
+            /* The transfer continues on its own, move on to the next
+               request */
+            vdagent_x11_send_selection_notify(x11, prop, selection, NULL);
+        } else {
+            SELPRINTF("clipboard data sent failed, requestor window gone");
+            g_bytes_unref(send->data);
+            free(send);
+            vdagent_x11_send_selection_notify(x11, None, selection, NULL);
+        }
+    } else {
+        vdagent_x11_set_error_handler(x11, vdagent_x11_ignore_bad_window_handler);
+        XChangeProperty(x11->display, event->xselectionrequest.requestor, prop,
+                        event->xselectionrequest.target, 8, PropModeReplace,
+                        data, size);
+        if (vdagent_x11_restore_error_handler(x11) == 0) {
+            vdagent_x11_send_selection_notify(x11, prop, selection, NULL);
+        } else {
+            SELPRINTF("clipboard data sent failed, requestor window gone");
+            vdagent_x11_send_selection_notify(x11, None, selection, NULL);
+        }
+    }
+}
+
+static void vdagent_x11_clipboard_cache_remove(struct vdagent_x11 *x11,
+                                               GList *link)
+{
+    struct vdagent_x11_clipboard_cache_entry *entry = link->data;
+
+    x11->clipboard_cache_size -= g_bytes_get_size(entry->data);
+    g_bytes_unref(entry->data);
+    free(entry);
+    g_queue_delete_link(&x11->clipboard_cache, link);
+}
+
+/* Drop the cached data of selection, or of all selections if selection
+   is -1 */
+static void vdagent_x11_clipboard_cache_clear(struct vdagent_x11 *x11,
+                                              int selection)
+{
+    struct vdagent_x11_clipboard_cache_entry *entry;
+    GList *link, *next;
+
+    for (link = x11->clipboard_cache.head; link; link = next) {
+        next = link->next;
+        entry = link->data;
+        if (selection == -1 || entry->selection == selection)
+            vdagent_x11_clipboard_cache_remove(x11, link);
+    }
+}
+
+static GBytes *vdagent_x11_clipboard_cache_lookup(struct vdagent_x11 *x11,
+    uint8_t selection, uint32_t type)
+{
+    struct vdagent_x11_clipboard_cache_entry *entry;
+    GList *link;
+
+    for (link = x11->clipboard_cache.head; link; link = link->next) {
+        entry = link->data;
+        if (entry->selection == selection && entry->type == type) {
+            /* Move it to the front, as the most recently used entry */
+            g_queue_unlink(&x11->clipboard_cache, link);
+            g_queue_push_head_link(&x11->clipboard_cache, link);
+            return entry->data;
+        }
+    }
+    return NULL;
+}
+
+static void vdagent_x11_clipboard_cache_add(struct vdagent_x11 *x11,
+    uint8_t selection, uint32_t type, GBytes *data)
+{
+    struct vdagent_x11_clipboard_cache_entry *entry;
+    gsize size = g_bytes_get_size(data);
+    GList *link;
+
+    if (size == 0 || size > CLIPBOARD_CACHE_MAX_SIZE)
+        return;
+
+    /* Replace the data of an earlier request for the same type */
+    for (link = x11->clipboard_cache.head; link; link = link->next) {
+        entry = link->data;
+        if (entry->selection == selection && entry->type == type) {
+            vdagent_x11_clipboard_cache_remove(x11, link);
+            break;
+        }
+    }
+
+    /* Make room by dropping the least recently used entries */
+    while (x11->clipboard_cache_size + size > CLIPBOARD_CACHE_MAX_SIZE)
+        vdagent_x11_clipboard_cache_remove(x11,
+                                  g_queue_peek_tail_link(&x11->clipboard_cache));
+
+    entry = malloc(sizeof(*entry));
+    if (!entry)
+        return;
+    entry->selection = selection;
+    entry->type = type;
+    entry->data = g_bytes_ref(data);
+    g_queue_push_head(&x11->clipboard_cache, entry);
+    x11->clipboard_cache_size += size;
+}
+
+/* Answer the selection_req of selection being processed with the
+   converted data, after which the next one gets handled */
+static void vdagent_x11_selection_request_converted(struct vdagent_x11 *x11,
+    uint8_t selection, uint32_t type, GBytes *converted)
+{
+    if (!converted) {
+        vdagent_x11_send_selection_notify(x11, None, selection, NULL);
+        return;
+    }
+    vdagent_x11_clipboard_cache_add(x11, selection, type, converted);
+    vdagent_x11_send_clipboard_data(x11, selection, converted);
+    g_bytes_unref(converted);
+}
+
+static void vdagent_x11_handle_selection_request(struct vdagent_x11 *x11,
+                                                 uint8_t selection)
 {
     XEvent *event;
-    uint32_t type = VD_AGENT_CLIPBOARD_NONE;
-    uint8_t selection;
+    uint32_t type = VD_AGENT_CLIPBOARD_NONE, source_type;
+    GBytes *bytes;
 
-    if (!x11->selection_req)
+    if (!x11->selections[selection].selection_req)
         return;
 
-    event = &x11->selection_req->event;
-    selection = x11->selection_req->selection;
+    event = &x11->selections[selection].selection_req->event;
 
-    if (x11->clipboard_owner[selection] != owner_client) {
+    if (x11->selections[selection].owner != owner_client) {
         SELPRINTF("received selection request event for target %s, "
                   "while not owning client clipboard",
             vdagent_x11_get_atom_name(x11, event->xselectionrequest.target));
-        vdagent_x11_send_selection_notify(x11, None, NULL);
+        vdagent_x11_send_selection_notify(x11, None, selection, NULL);
         return;
     }
 
     if (event->xselectionrequest.target == x11->multiple_atom) {
         SELPRINTF("multiple target not supported");
-        vdagent_x11_send_selection_notify(x11, None, NULL);
+        vdagent_x11_send_selection_notify(x11, None, selection, NULL);
         return;
     }
 
@@ -1048,7 +1812,7 @@ static void vdagent_x11_handle_selection_request(struct vdagent_x11 *x11)
                         event->xselectionrequest.target, 32, PropModeReplace,
                         (guint8*)&timestamp, 1);
         vdagent_x11_send_selection_notify(x11,
-                       event->xselectionrequest.property, NULL);
+                       event->xselectionrequest.property, selection, NULL);
        return;
     }
 
@@ -1060,69 +1824,91 @@ static void vdagent_x11_handle_selection_request(struct vdagent_x11 *x11)
 
     type = vdagent_x11_target_to_type(x11, selection,
                                       event->xselectionrequest.target);
-    if (type == VD_AGENT_CLIPBOARD_NONE) {
+    source_type = vdagent_x11_clipboard_source_type(x11, selection, type);
+    if (source_type == VD_AGENT_CLIPBOARD_NONE) {
         VSELPRINTF("guest app requested a non-advertised target");
-        vdagent_x11_send_selection_notify(x11, None, NULL);
+        vdagent_x11_send_selection_notify(x11, None, selection, NULL);
         return;
     }
 
-    udscs_write(x11->vdagentd, VDAGENTD_CLIPBOARD_REQUEST, selection, type,
-                NULL, 0);
+    if (vdagent_x11_incr_send_count(x11, event->xselectionrequest.requestor)
+            >= MAX_INCR_SENDS_PER_REQUESTOR) {
+        SELPRINTF("too many incr sends to requestor 0x%lx, refusing request",
+                  event->xselectionrequest.requestor);
+        vdagent_x11_send_selection_notify(x11, None, selection, NULL);
+        return;
+    }
+
+    /* The client clipboard has not changed since we got this data */
+    bytes = vdagent_x11_clipboard_cache_lookup(x11, selection, type);
+    if (bytes) {
+        VSELPRINTF("sending %u bytes of cached clipboard data",
+                   (unsigned int)g_bytes_get_size(bytes));
+        vdagent_x11_send_clipboard_data(x11, selection, bytes);
+        return;
+    }
+
+    /* Data we need to convert may have been fetched already */
+    bytes = vdagent_x11_clipboard_cache_lookup(x11, selection, source_type);
+    if (bytes) {
+        vdagent_x11_convert_clipboard_data(x11, selection, source_type, type,
+            bytes, &x11->selections[selection].selection_req->image_conversion,
+            vdagent_x11_selection_request_converted);
+        return;
+    }
+
+    udscs_write(x11->vdagentd, VDAGENTD_CLIPBOARD_REQUEST, selection,
+                source_type, NULL, 0);
 }
 
 static void vdagent_x11_handle_property_delete_notify(struct vdagent_x11 *x11,
                                                       XEvent *del_event)
 {
-    XEvent *sel_event;
+    struct vdagent_x11_incr_send *send;
+    const uint8_t *data;
+    gsize size;
     int len;
     uint8_t selection;
 
-    assert(x11->selection_req);
-    sel_event = &x11->selection_req->event;
-    selection = x11->selection_req->selection;
-    if (del_event->xproperty.window != sel_event->xselectionrequest.requestor
-            || del_event->xproperty.atom != x11->selection_req_atom) {
-        return;
+    for (send = x11->incr_sends; send; send = send->next) {
+        if (del_event->xproperty.window == send->requestor &&
+                del_event->xproperty.atom == send->property)
+            break;
     }
+    if (!send)
+        return;
 
-    len = x11->selection_req_data_size - x11->selection_req_data_pos;
+    selection = send->selection;
+    data = g_bytes_get_data(send->data, &size);
+    len = size - send->pos;
     if (len > x11->max_prop_size) {
         len = x11->max_prop_size;
     }
 
     if (len) {
         VSELPRINTF("Sending %d-%d/%d bytes of clipboard data",
-                x11->selection_req_data_pos,
-                x11->selection_req_data_pos + len - 1,
-                x11->selection_req_data_size);
+                send->pos, send->pos + len - 1, (int)size);
     } else {
         VSELPRINTF("Ending incr send of clipboard data");
     }
     vdagent_x11_set_error_handler(x11, vdagent_x11_ignore_bad_window_handler);
-    XChangeProperty(x11->display, sel_event->xselectionrequest.requestor,
-                    x11->selection_req_atom,
-                    sel_event->xselectionrequest.target, 8, PropModeReplace,
-                    x11->selection_req_data + x11->selection_req_data_pos,
-                    len);
+    XChangeProperty(x11->display, send->requestor, send->property,
+                    send->target, 8, PropModeReplace,
+                    data + send->pos, len);
     if (vdagent_x11_restore_error_handler(x11)) {
         SELPRINTF("incr sent failed, requestor window gone");
         len = 0;
     }
 
-    x11->selection_req_data_pos += len;
+    send->pos += len;
 
     /* Note we must explicitly send a 0 sized XChangeProperty to signal the
        incr transfer is done. Hence we do not check if we've send all data
        but instead check we've send the final 0 sized XChangeProperty. */
-    if (len == 0) {
-        free(x11->selection_req_data);
-        x11->selection_req_data = NULL;
-        x11->selection_req_data_pos = 0;
-        x11->selection_req_data_size = 0;
-        x11->selection_req_atom = None;
-        vdagent_x11_next_selection_request(x11);
-        vdagent_x11_handle_selection_request(x11);
-    }
+    if (len == 0)
+        vdagent_x11_incr_send_free(send);
+    else
+        vdagent_x11_incr_send_touch(send);
 }
 
 void vdagent_x11_clipboard_request(struct vdagent_x11 *x11,
@@ -1130,6 +1916,7 @@ void vdagent_x11_clipboard_request(struct vdagent_x11 *x11,
 {
     Atom target, clip;
     struct vdagent_x11_conversion_request *req, *new_req;
+    GBytes *bytes;
 
     /* We don't use clip here, but we call get_clipboard_atom to verify
        selection is valid */
@@ -1137,7 +1924,7 @@ void vdagent_x11_clipboard_request(struct vdagent_x11 *x11,
         goto none;
     }
 
-    if (x11->clipboard_owner[selection] != owner_guest) {
+    if (x11->selections[selection].owner != owner_guest) {
         SELPRINTF("received clipboard req while not owning guest clipboard");
         goto none;
     }
@@ -1147,26 +1934,37 @@ void vdagent_x11_clipboard_request(struct vdagent_x11 *x11,
         goto none;
     }
 
+    /* We've already converted the data of the current owner to type */
+    bytes = vdagent_x11_clipboard_cache_lookup(x11, selection, type);
+    if (bytes) {
+        vdagent_x11_send_selection_bytes(x11, selection, type, bytes);
+        return;
+    }
+
     new_req = malloc(sizeof(*new_req));
     if (!new_req) {
         SELPRINTF("out of memory on client clipboard request, ignoring.");
         return;
     }
 
+    new_req->x11 = x11;
     new_req->target = target;
+    new_req->type = type;
     new_req->selection = selection;
+    new_req->timeout_id = 0;
+    new_req->image_conversion = NULL;
     new_req->next = NULL;
 
-    if (!x11->conversion_req) {
-        x11->conversion_req = new_req;
-        vdagent_x11_handle_conversion_request(x11);
+    if (!x11->selections[selection].conversion_req) {
+        x11->selections[selection].conversion_req = new_req;
+        vdagent_x11_handle_conversion_request(x11, selection);
         /* Flush output buffers and consume any pending events */
         vdagent_x11_do_read(x11);
         return;
     }
 
     /* maybe we should limit the conversion_request stack depth ? */
-    req = x11->conversion_req;
+    req = x11->selections[selection].conversion_req;
     while (req->next)
         req = req->next;
 
@@ -1187,14 +1985,12 @@ void vdagent_x11_clipboard_grab(struct vdagent_x11 *x11, uint8_t selection,
         return;
     }
 
-    if (type_count > sizeof(x11->clipboard_agent_types[0])/sizeof(uint32_t)) {
+    if (type_count > MAX_CLIPBOARD_TYPES) {
         SELPRINTF("x11_clipboard_grab: too many types");
-        type_count = sizeof(x11->clipboard_agent_types[0])/sizeof(uint32_t);
+        type_count = MAX_CLIPBOARD_TYPES;
     }
 
-    memcpy(x11->clipboard_agent_types[selection], types,
-           type_count * sizeof(uint32_t));
-    x11->clipboard_type_count[selection] = type_count;
+    vdagent_x11_clipboard_types_set(x11, selection, types, NULL, type_count);
 
     XSetSelectionOwner(x11->display, clip,
                        x11->selection_window, CurrentTime);
@@ -1207,19 +2003,23 @@ void vdagent_x11_clipboard_grab(struct vdagent_x11 *x11, uint8_t selection,
 void vdagent_x11_clipboard_data(struct vdagent_x11 *x11, uint8_t selection,
     uint32_t type, uint8_t *data, uint32_t size)
 {
-    Atom prop;
+    struct vdagent_x11_selection_request *req;
     XEvent *event;
-    uint32_t type_from_event;
+    uint32_t type_from_event, source_type;
+    uint8_t *buf;
+    GBytes *bytes;
+    Atom clip = None;
 
-    if (x11->selection_req_data) {
-        if (type || size) {
-            SELPRINTF("received clipboard data while still sending"
-                      " data from previous request, ignoring");
-        }
+    /* We don't use clip here, but we call get_clipboard_atom to verify
+       selection is valid */
+    if (vdagent_x11_get_clipboard_atom(x11, selection, &clip)) {
         return;
     }
 
-    if (!x11->selection_req) {
+    /* A request whose data is being converted has been answered by the
+       client already */
+    req = x11->selections[selection].selection_req;
+    if (!req || req->image_conversion) {
         if (type || size) {
             SELPRINTF("received clipboard data without an "
                       "outstanding selection request, ignoring");
@@ -1227,66 +2027,40 @@ void vdagent_x11_clipboard_data(struct vdagent_x11 *x11, uint8_t selection,
         return;
     }
 
-    event = &x11->selection_req->event;
-    type_from_event = vdagent_x11_target_to_type(x11,
-                                             x11->selection_req->selection,
+    event = &req->event;
+    type_from_event = vdagent_x11_target_to_type(x11, selection,
                                              event->xselectionrequest.target);
-    if (type_from_event != type ||
-            selection != x11->selection_req->selection) {
-        if (selection != x11->selection_req->selection) {
-            SELPRINTF("expecting data for selection %d got %d",
-                      (int)x11->selection_req->selection, (int)selection);
-        }
-        if (type_from_event != type) {
-            SELPRINTF("expecting type %u clipboard data got %u",
-                      type_from_event, type);
-        }
-        vdagent_x11_send_selection_notify(x11, None, NULL);
+    source_type = vdagent_x11_clipboard_source_type(x11, selection,
+                                                    type_from_event);
+    if (source_type != type) {
+        SELPRINTF("expecting type %u clipboard data got %u",
+                  source_type, type);
+        vdagent_x11_send_selection_notify(x11, None, selection, NULL);
 
         /* Flush output buffers and consume any pending events */
         vdagent_x11_do_read(x11);
         return;
     }
 
-    prop = event->xselectionrequest.property;
-    if (prop == None)
-        prop = event->xselectionrequest.target;
-
-    if (size > x11->max_prop_size) {
-        unsigned long len = size;
-        VSELPRINTF("Starting incr send of clipboard data");
-
-        vdagent_x11_set_error_handler(x11, vdagent_x11_ignore_bad_window_handler);
-        XSelectInput(x11->display, event->xselectionrequest.requestor,
-                     PropertyChangeMask);
-        XChangeProperty(x11->display, event->xselectionrequest.requestor, prop,
-                        x11->incr_atom, 32, PropModeReplace,
-                        (unsigned char*)&len, 1);
-        if (vdagent_x11_restore_error_handler(x11) == 0) {
-            /* duplicate data */
-            x11->selection_req_data = malloc(size);
-            if (x11->selection_req_data != NULL) {
-                memcpy(x11->selection_req_data, data, size);
-                x11->selection_req_data_pos = 0;
-                x11->selection_req_data_size = size;
-                x11->selection_req_atom = prop;
-                vdagent_x11_send_selection_notify(x11, prop, x11->selection_req);
-            } else {
-                SELPRINTF("out of memory allocating selection buffer");
-            }
-        } else {
-            SELPRINTF("clipboard data sent failed, requestor window gone");
-        }
+    /* Take over the buffer the data was received in, rather than copying
+       it, so that it can be cached and used for an INCR send as is */
+    buf = udscs_steal_data(x11->vdagentd);
+    if (!buf && size) {
+        SELPRINTF("out of memory allocating selection buffer");
+        vdagent_x11_send_selection_notify(x11, None, selection, NULL);
+        vdagent_x11_do_read(x11);
+        return;
+    }
+    bytes = g_bytes_new_take(buf, size);
+    vdagent_x11_clipboard_cache_add(x11, selection, type, bytes);
+    if (type_from_event != type) {
+        vdagent_x11_convert_clipboard_data(x11, selection, type,
+            type_from_event, bytes, &req->image_conversion,
+            vdagent_x11_selection_request_converted);
     } else {
-        vdagent_x11_set_error_handler(x11, vdagent_x11_ignore_bad_window_handler);
-        XChangeProperty(x11->display, event->xselectionrequest.requestor, prop,
-                        event->xselectionrequest.target, 8, PropModeReplace,
-                        data, size);
-        if (vdagent_x11_restore_error_handler(x11) == 0)
-            vdagent_x11_send_selection_notify(x11, prop, NULL);
-        else
-            SELPRINTF("clipboard data sent failed, requestor window gone");
+        vdagent_x11_send_clipboard_data(x11, selection, bytes);
     }
+    g_bytes_unref(bytes);
 
     /* Flush output buffers and consume any pending events */
     vdagent_x11_do_read(x11);
@@ -1301,7 +2075,7 @@ void vdagent_x11_clipboard_release(struct vdagent_x11 *x11, uint8_t selection)
         return;
     }
 
-    if (x11->clipboard_owner[selection] != owner_client) {
+    if (x11->selections[selection].owner != owner_client) {
         VSELPRINTF("received release while not owning client clipboard");
         return;
     }
@@ -1326,8 +2100,8 @@ void vdagent_x11_client_disconnected(struct vdagent_x11 *x11)
 {
     int sel;
 
-    for (sel = 0; sel < VD_AGENT_CLIPBOARD_SELECTION_SECONDARY; sel++) {
-        if (x11->clipboard_owner[sel] == owner_client)
+    for (sel = 0; sel < VDAGENT_X11_SELECTION_COUNT; sel++) {
+        if (x11->selections[sel].owner == owner_client)
             vdagent_x11_clipboard_release(x11, sel);
     }
 }
@@ -42,6 +42,8 @@ void vdagent_x11_clipboard_grab(struct vdagent_x11 *x11, uint8_t selection,
     uint32_t *types, uint32_t type_count);
 void vdagent_x11_clipboard_request(struct vdagent_x11 *x11,
     uint8_t selection, uint32_t type);
+/* Must be called from the read callback of x11's vdagentd connection with
+   the data of the message, as it may take over the buffer of the message */
 void vdagent_x11_clipboard_data(struct vdagent_x11 *x11, uint8_t selection,
     uint32_t type, uint8_t *data, uint32_t size);
 void vdagent_x11_clipboard_release(struct vdagent_x11 *x11, uint8_t selection);
@@ -36,6 +36,7 @@ static const char * const vdagentd_messages[] = {
         "file xfer data",
         "file xfer disable",
         "client disconnected",
+        "clipboard data chunk",
 };
 
 #endif
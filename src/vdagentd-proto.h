@@ -39,11 +39,22 @@ enum {
     VDAGENTD_CLIPBOARD_RELEASE, /* arg1: selection */
     VDAGENTD_VERSION,           /* daemon -> client, data: version string */
     VDAGENTD_AUDIO_VOLUME_SYNC,
-    VDAGENTD_FILE_XFER_START,
-    VDAGENTD_FILE_XFER_STATUS,
+    VDAGENTD_FILE_XFER_START,   /* arg1: 1 if the file data will be written
+                                   to a pipe passed along with this msg,
+                                   instead of being sent in FILE_XFER_DATA
+                                   messages */
+    VDAGENTD_FILE_XFER_STATUS,  /* arg1: id, arg2: status, data: for
+                                   SUCCESS the SHA-256 of the file, when
+                                   checksums are enabled in the agent */
     VDAGENTD_FILE_XFER_DATA,
     VDAGENTD_FILE_XFER_DISABLE,
     VDAGENTD_CLIENT_DISCONNECTED,  /* daemon -> client */
+    VDAGENTD_CLIPBOARD_DATA_CHUNK, /* client -> daemon, arg1: sel, arg2: size
+                                      hint (lower bound of the total size),
+                                      data: part of the data of a large
+                                      selection, the rest of it follows in
+                                      more CHUNK msgs, ended by a
+                                      CLIPBOARD_DATA msg with the last part */
     VDAGENTD_NO_MESSAGES /* Must always be last */
 };
 
@@ -0,0 +1,167 @@
+/*  event-loop.c vdagentd epoll based event loop
+
+    Copyright 2017 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <errno.h>
+#include "event-loop.h"
+
+/* Maximum number of events fetched by a single epoll_wait() call, any
+   remaining ready fds simply get reported by the next call */
+#define MAX_EVENTS 64
+
+struct vdagentd_event_watch {
+    struct vdagentd_event_loop *loop;
+    int fd;
+    vdagentd_event_callback callback;
+    void *opaque;
+
+    struct vdagentd_event_watch *next_removed;
+};
+
+struct vdagentd_event_loop {
+    int epoll_fd;
+    int dispatching;
+    /* Watches removed while dispatching, freed once the dispatch is done,
+       as the events array may still reference them. */
+    struct vdagentd_event_watch *removed;
+};
+
+struct vdagentd_event_loop *vdagentd_event_loop_create(void)
+{
+    struct vdagentd_event_loop *loop;
+
+    loop = calloc(1, sizeof(*loop));
+    if (!loop)
+        return NULL;
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd == -1) {
+        syslog(LOG_ERR, "epoll_create1: %m");
+        free(loop);
+        return NULL;
+    }
+
+    return loop;
+}
+
+void vdagentd_event_loop_destroy(struct vdagentd_event_loop *loop)
+{
+    if (!loop)
+        return;
+
+    close(loop->epoll_fd);
+    free(loop);
+}
+
+struct vdagentd_event_watch *vdagentd_event_loop_add_watch(
+    struct vdagentd_event_loop *loop, int fd, uint32_t events,
+    vdagentd_event_callback callback, void *opaque)
+{
+    struct vdagentd_event_watch *watch;
+    struct epoll_event ev;
+
+    watch = calloc(1, sizeof(*watch));
+    if (!watch)
+        return NULL;
+
+    watch->loop = loop;
+    watch->fd = fd;
+    watch->callback = callback;
+    watch->opaque = opaque;
+
+    ev.events = events;
+    ev.data.ptr = watch;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        syslog(LOG_ERR, "epoll_ctl add fd %d: %m", fd);
+        free(watch);
+        return NULL;
+    }
+
+    return watch;
+}
+
+int vdagentd_event_watch_set_events(struct vdagentd_event_watch *watch,
+    uint32_t events)
+{
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.ptr = watch;
+    if (epoll_ctl(watch->loop->epoll_fd, EPOLL_CTL_MOD, watch->fd, &ev) != 0) {
+        syslog(LOG_ERR, "epoll_ctl mod fd %d: %m", watch->fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+void vdagentd_event_loop_remove_watch(struct vdagentd_event_watch *watch)
+{
+    struct vdagentd_event_loop *loop;
+
+    if (!watch)
+        return;
+
+    loop = watch->loop;
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, watch->fd, NULL);
+
+    if (!loop->dispatching) {
+        free(watch);
+        return;
+    }
+
+    watch->callback = NULL;
+    watch->next_removed = loop->removed;
+    loop->removed = watch;
+}
+
+int vdagentd_event_loop_iterate(struct vdagentd_event_loop *loop)
+{
+    struct epoll_event events[MAX_EVENTS];
+    struct vdagentd_event_watch *watch;
+    int i, n;
+
+    n = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, -1);
+    if (n == -1) {
+        if (errno == EINTR)
+            return 0;
+        syslog(LOG_CRIT, "Fatal error epoll_wait: %m");
+        return -1;
+    }
+
+    loop->dispatching = 1;
+    for (i = 0; i < n; i++) {
+        watch = events[i].data.ptr;
+        if (watch->callback)
+            watch->callback(watch->opaque, events[i].events);
+    }
+    loop->dispatching = 0;
+
+    while (loop->removed) {
+        watch = loop->removed;
+        loop->removed = watch->next_removed;
+        free(watch);
+    }
+
+    return 0;
+}
@@ -0,0 +1,61 @@
+/*  event-loop.h vdagentd epoll based event loop header file
+
+    Copyright 2017 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __VDAGENTD_EVENT_LOOP_H
+#define __VDAGENTD_EVENT_LOOP_H
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+struct vdagentd_event_loop;
+struct vdagentd_event_watch;
+
+/* Callbacks with this type will be called when epoll reports events for the
+   watched fd. events is the EPOLL* event mask as returned by epoll_wait().
+   The callback may remove its own watch, or any other watch, pending events
+   for removed watches are silently dropped. */
+typedef void (*vdagentd_event_callback)(void *opaque, uint32_t events);
+
+struct vdagentd_event_loop *vdagentd_event_loop_create(void);
+void vdagentd_event_loop_destroy(struct vdagentd_event_loop *loop);
+
+/* Start watching fd for events (EPOLLIN, EPOLLOUT, optionally EPOLLET).
+   Note that with EPOLLET the owner of fd must make it non-blocking and must
+   consume all input / fill the output until it gets EAGAIN.
+
+   Return value: the new watch, or NULL on error */
+struct vdagentd_event_watch *vdagentd_event_loop_add_watch(
+    struct vdagentd_event_loop *loop, int fd, uint32_t events,
+    vdagentd_event_callback callback, void *opaque);
+
+/* Change the set of events the watch is interested in. Re-arming EPOLLOUT
+   on an edge-triggered watch reports the fd again if it is writable.
+   Return value: 0 on success, -1 on error */
+int vdagentd_event_watch_set_events(struct vdagentd_event_watch *watch,
+    uint32_t events);
+
+/* Stop watching and free the watch. Must be called before closing the fd.
+   Does nothing if watch is NULL. */
+void vdagentd_event_loop_remove_watch(struct vdagentd_event_watch *watch);
+
+/* Wait for events and dispatch them to the watch callbacks.
+   Return value: 0 on success (including being interrupted by a signal),
+                 -1 on a fatal error */
+int vdagentd_event_loop_iterate(struct vdagentd_event_loop *loop);
+
+#endif
@@ -31,8 +31,10 @@
 #include <errno.h>
 #include <signal.h>
 #include <syslog.h>
-#include <sys/select.h>
 #include <sys/stat.h>
+#ifdef HAVE_MEMFD_CREATE
+#include <sys/mman.h>
+#endif
 #include <spice/vd_agent.h>
 #include <glib.h>
 
@@ -47,6 +49,32 @@
 #include "xorg-conf.h"
 #include "virtio-port.h"
 #include "session-info.h"
+#include "event-loop.h"
+
+/* Size of the pipes through which file-xfer data is passed to the agent */
+#define FILE_XFER_PIPE_SIZE (1024 * 1024)
+/* The data of file-xfers which the agents are not keeping up with is kept
+   in a backlog, so that the other messages of the client still get handled.
+   The data of all messages comes through the virtio port, so the client can
+   not be throttled per file-xfer, once the backlogs grow beyond this we
+   stop reading from the port altogether. */
+#define FILE_XFER_BACKLOG_SIZE (16 * 1024 * 1024)
+
+/* A file transfer from the client to an agent */
+struct active_xfer {
+    struct udscs_connection *conn;
+    /* When use_pipe is set the file data is written to pipe_fd, rather than
+       being sent as VDAGENTD_FILE_XFER_DATA messages. pipe_fd becomes -1
+       when the agent closes its end of the pipe */
+    int use_pipe;
+    int pipe_fd;
+    struct vdagentd_event_watch *pipe_watch;
+    /* Data (GBytes) which the agent has not accepted yet, as it is not
+       keeping up. backlog_pos bytes of the first one have been written to
+       the pipe already. */
+    GQueue backlog;
+    size_t backlog_pos;
+};
 
 struct agent_data {
     char *session;
@@ -54,8 +82,31 @@ struct agent_data {
     int height;
     struct vdagentd_guest_xorg_resolution *screen_info;
     int screen_count;
+    /* Set when we've stopped reading from the agent because the client is
+       not keeping up with the data we send it */
+    int read_paused;
 };
 
+/* Data of a large selection which the agent is sending us in chunks */
+struct agent_clipboard_chunks {
+    GByteArray *data;
+    /* Once the data gets larger than AGENT_CLIPBOARD_SPOOL_SIZE it is moved
+       to an anonymous spool file, from which the virtio port reads it a bit
+       at a time while sending it to the client */
+    int spool_fd;
+    uint32_t size;
+    /* Set when the data is to be dropped, as it is too large */
+    int discard;
+};
+
+#define AGENT_CLIPBOARD_SPOOL_SIZE (1024 * 1024)
+/* The clipboard is spooled to memory, which is why its size is always
+   limited, this is used when the client has not told us its maximum */
+#define AGENT_CLIPBOARD_DEFAULT_MAX_SIZE (100 * 1024 * 1024)
+/* Directory for spool files when memfd_create() is not available, only the
+   files created in it with O_TMPFILE need to be inaccessible to others */
+#define AGENT_CLIPBOARD_SPOOL_DIR "/var/run/spice-vdagentd"
+
 /* variables */
 static const char *pidfilename = "/var/run/spice-vdagentd/spice-vdagentd.pid";
 static const char *portdev = DEFAULT_VIRTIO_PORT_PATH;
@@ -64,10 +115,13 @@ static const char *uinput_device = "/dev/uinput";
 static int debug = 0;
 static int uinput_fake = 0;
 static int only_once = 0;
+static int virtio_read_buf_size = VIRTIO_PORT_DEFAULT_READ_BUF_SIZE;
+static struct vdagentd_event_loop *event_loop = NULL;
 static struct udscs_server *server = NULL;
 static struct vdagent_virtio_port *virtio_port = NULL;
 static GHashTable *active_xfers = NULL;
 static struct session_info *session_info = NULL;
+static struct vdagentd_event_watch *session_info_watch = NULL;
 static struct vdagentd_uinput *uinput = NULL;
 static VDAgentMonitorsConfig *mon_config = NULL;
 static uint32_t *capabilities = NULL;
@@ -76,10 +130,22 @@ static const char *active_session = NULL;
 static unsigned int session_count = 0;
 static struct udscs_connection *active_session_conn = NULL;
 static int agent_owns_clipboard[256] = { 0, };
+static struct agent_clipboard_chunks *agent_clipboard_chunks[256] = { NULL, };
 static int quit = 0;
 static int retval = 0;
 static int client_connected = 0;
 static int max_clipboard = -1;
+/* Total size of the backlogs of all file-xfers */
+static size_t file_xfer_backlog_size = 0;
+/* The file-xfer whose data message is being streamed to its pipe, and the
+   amount of file data in the message which is still to come */
+static uint32_t streamed_xfer_id = 0;
+static uint64_t streamed_xfer_remaining = 0;
+/* Set when we've stopped reading from the virtio port because the file-xfer
+   backlogs have grown too large */
+static int virtio_port_throttled = 0;
+/* Set when we've stopped reading from one or more agents */
+static int agents_throttled = 0;
 
 /* utility functions */
 static void virtio_msg_uint32_to_le(uint8_t *_msg, uint32_t size, uint32_t offset)
@@ -253,11 +319,40 @@ static void do_client_capabilities(struct vdagent_virtio_port *vport,
     }
 }
 
+/* Take over the data of the message the virtio port is passing to us, so
+   that size bytes of it at data can be handed to an agent without copying
+   them. msg_data is the data of the message, data must lie within it.
+   Return value: the data, NULL if size is 0 */
+static GBytes *virtio_steal_message_data(struct vdagent_virtio_port *vport,
+    VDAgentMessage *message_header, uint8_t *msg_data,
+    const uint8_t *data, uint32_t size)
+{
+    GBytes *bytes, *part;
+    uint8_t *buf;
+
+    if (size == 0)
+        return NULL;
+
+    buf = vdagent_virtio_port_steal_data(vport);
+    if (!buf)
+        return g_bytes_new(data, size);
+
+    bytes = g_bytes_new_take(buf, message_header->size);
+    if (size == message_header->size)
+        return bytes;
+
+    part = g_bytes_new_from_bytes(bytes, data - msg_data, size);
+    g_bytes_unref(bytes);
+    return part;
+}
+
 static void do_client_clipboard(struct vdagent_virtio_port *vport,
     VDAgentMessage *message_header, uint8_t *data)
 {
     uint32_t msg_type = 0, data_type = 0, size = message_header->size;
     uint8_t selection = VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD;
+    uint8_t *msg_data = data;
+    GBytes *bytes;
 
     if (!active_session_conn) {
         syslog(LOG_WARNING,
@@ -301,6 +396,15 @@ static void do_client_clipboard(struct vdagent_virtio_port *vport,
         break;
     }
 
+    if (msg_type == VDAGENTD_CLIPBOARD_DATA &&
+            (bytes = virtio_steal_message_data(vport, message_header,
+                                               msg_data, data, size))) {
+        udscs_write_bytes(active_session_conn, msg_type, selection,
+                          data_type, bytes);
+        g_bytes_unref(bytes);
+        return;
+    }
+
     udscs_write(active_session_conn, msg_type, selection, data_type,
                 data, size);
 }
@@ -339,12 +443,214 @@ static void send_file_xfer_status(struct vdagent_virtio_port *vport,
     free(status);
 }
 
+static void active_xfer_drop_backlog(struct active_xfer *xfer)
+{
+    GBytes *bytes;
+
+    while ((bytes = g_queue_pop_head(&xfer->backlog))) {
+        file_xfer_backlog_size -= g_bytes_get_size(bytes);
+        g_bytes_unref(bytes);
+    }
+    xfer->backlog_pos = 0;
+}
+
+static void active_xfer_free(gpointer data)
+{
+    struct active_xfer *xfer = data;
+
+    vdagentd_event_loop_remove_watch(xfer->pipe_watch);
+    if (xfer->pipe_fd != -1)
+        close(xfer->pipe_fd);
+    active_xfer_drop_backlog(xfer);
+    g_free(xfer);
+}
+
+/* Stop reading from the virtio port, so that the client gets throttled by
+   the virtio ring rather than us queueing up an unbounded amount of data
+   when the agents can't keep up writing the data of file-xfers to disk */
+static void throttle_virtio_port(struct vdagent_virtio_port *vport)
+{
+    if (virtio_port_throttled)
+        return;
+
+    if (debug)
+        syslog(LOG_DEBUG, "agent is not keeping up, throttling client");
+    virtio_port_throttled = 1;
+    vdagent_virtio_port_set_read_paused(vport, 1);
+}
+
+/* Called when writing to the file-xfer pipe fails, most likely because the
+   agent has closed its end of it, it reports the outcome of the file-xfer
+   through a VDAGENTD_FILE_XFER_STATUS message. Any further data is dropped. */
+static void active_xfer_close_pipe(struct active_xfer *xfer)
+{
+    vdagentd_event_loop_remove_watch(xfer->pipe_watch);
+    xfer->pipe_watch = NULL;
+    close(xfer->pipe_fd);
+    xfer->pipe_fd = -1;
+    active_xfer_drop_backlog(xfer);
+}
+
+/* Write as much of data to the pipe of a file-xfer as fits in it
+   Return value: the number of bytes written, -1 if the pipe got closed */
+static ssize_t active_xfer_write_pipe(struct active_xfer *xfer,
+                                      const uint8_t *data, size_t size)
+{
+    size_t pos = 0;
+    ssize_t n;
+
+    while (pos < size) {
+        n = write(xfer->pipe_fd, data + pos, size - pos);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+                break;
+            if (errno != EPIPE)
+                syslog(LOG_ERR, "writing to file-xfer pipe: %m");
+            active_xfer_close_pipe(xfer);
+            return -1;
+        }
+        pos += n;
+    }
+    return pos;
+}
+
+/* Pass as much of the backlog of a file-xfer on to the agent as it accepts
+   Return value: 0 if the backlog is empty, -1 otherwise */
+static int active_xfer_write_backlog(struct active_xfer *xfer)
+{
+    GBytes *bytes;
+    const uint8_t *data;
+    gsize size;
+    ssize_t n;
+
+    while ((bytes = g_queue_peek_head(&xfer->backlog))) {
+        if (xfer->use_pipe) {
+            data = g_bytes_get_data(bytes, &size);
+            n = active_xfer_write_pipe(xfer, data + xfer->backlog_pos,
+                                       size - xfer->backlog_pos);
+            if (n < 0)
+                return 0;
+            xfer->backlog_pos += n;
+            if (xfer->backlog_pos < size)
+                return -1;
+        } else {
+            if (udscs_write_queue_full(xfer->conn))
+                return -1;
+            udscs_write_bytes(xfer->conn, VDAGENTD_FILE_XFER_DATA, 0, 0,
+                              bytes);
+        }
+        g_queue_pop_head(&xfer->backlog);
+        file_xfer_backlog_size -= g_bytes_get_size(bytes);
+        xfer->backlog_pos = 0;
+        g_bytes_unref(bytes);
+    }
+
+    return 0;
+}
+
+static void active_xfer_pipe_event(void *opaque, uint32_t events);
+
+/* Pass on as much of the backlog of a file-xfer as the agent accepts, when
+   the pipe is full wait for it to become writable. The backlog of a
+   file-xfer sent as messages is retried from the main loop. */
+static void active_xfer_flush(struct active_xfer *xfer)
+{
+    if (active_xfer_write_backlog(xfer) == 0) {
+        vdagentd_event_loop_remove_watch(xfer->pipe_watch);
+        xfer->pipe_watch = NULL;
+        return;
+    }
+
+    if (xfer->use_pipe && !xfer->pipe_watch) {
+        xfer->pipe_watch = vdagentd_event_loop_add_watch(event_loop,
+                                                         xfer->pipe_fd,
+                                                         EPOLLOUT,
+                                                         active_xfer_pipe_event,
+                                                         xfer);
+        if (!xfer->pipe_watch)
+            active_xfer_close_pipe(xfer);
+    }
+}
+
+static void active_xfer_pipe_event(void *opaque, uint32_t events)
+{
+    active_xfer_flush(opaque);
+}
+
+/* Pass data of a file-xfer on to the agent, through its backlog so that
+   the data stays in order. Only when the backlogs of all file-xfers
+   together grow too large the client gets throttled. */
+static void active_xfer_send(struct vdagent_virtio_port *vport,
+                             struct active_xfer *xfer, GBytes *bytes)
+{
+    g_queue_push_tail(&xfer->backlog, bytes);
+    file_xfer_backlog_size += g_bytes_get_size(bytes);
+    active_xfer_flush(xfer);
+
+    if (file_xfer_backlog_size >= FILE_XFER_BACKLOG_SIZE)
+        throttle_virtio_port(vport);
+}
+
+/* Pass data of a file-xfer, straight from the virtio port's read buffer,
+   on to its pipe. What does not fit in the pipe gets copied into the
+   backlog. */
+static void active_xfer_stream(struct vdagent_virtio_port *vport,
+                               struct active_xfer *xfer,
+                               const uint8_t *data, size_t size)
+{
+    ssize_t n = 0;
+
+    if (xfer->pipe_fd == -1 || size == 0)
+        return;
+
+    if (g_queue_is_empty(&xfer->backlog)) {
+        n = active_xfer_write_pipe(xfer, data, size);
+        if (n < 0 || (size_t)n == size)
+            return;
+    }
+    active_xfer_send(vport, xfer, g_bytes_new(data + n, size - n));
+}
+
+/* Forward a file-xfer start message to the agent in the active session, with
+   the read end of a pipe through which the file data will be passed */
+static void active_xfer_start(uint32_t id, uint8_t *data, uint32_t size)
+{
+    struct active_xfer *xfer;
+    int fds[2];
+
+    xfer = g_new0(struct active_xfer, 1);
+    xfer->conn = active_session_conn;
+    xfer->pipe_fd = -1;
+    g_queue_init(&xfer->backlog);
+
+    if (pipe2(fds, O_CLOEXEC | O_NONBLOCK) == 0) {
+        /* A larger pipe means less context switches between us and the
+           agent, this is just an optimization so ignore errors */
+        fcntl(fds[1], F_SETPIPE_SZ, FILE_XFER_PIPE_SIZE);
+        xfer->use_pipe = 1;
+        xfer->pipe_fd = fds[1];
+        udscs_write_fd(active_session_conn, VDAGENTD_FILE_XFER_START, 1, 0,
+                       data, size, fds[0]);
+    } else {
+        syslog(LOG_WARNING, "creating file-xfer pipe: %m, "
+               "falling back to sending the data as messages");
+        udscs_write(active_session_conn, VDAGENTD_FILE_XFER_START, 0, 0,
+                    data, size);
+    }
+
+    g_hash_table_insert(active_xfers, GUINT_TO_POINTER(id), xfer);
+}
+
 static void do_client_file_xfer(struct vdagent_virtio_port *vport,
                                 VDAgentMessage *message_header,
                                 uint8_t *data)
 {
     uint32_t msg_type, id;
-    struct udscs_connection *conn;
+    struct active_xfer *xfer;
+    GBytes *bytes;
+    ssize_t n;
 
     switch (message_header->type) {
     case VD_AGENT_FILE_XFER_START: {
@@ -363,8 +669,7 @@ static void do_client_file_xfer(struct vdagent_virtio_port *vport,
                s->id, VD_AGENT_FILE_XFER_STATUS_SESSION_LOCKED, NULL, 0);
             return;
         }
-        udscs_write(active_session_conn, VDAGENTD_FILE_XFER_START, 0, 0,
-                    data, message_header->size);
+        active_xfer_start(s->id, data, message_header->size);
         return;
     }
     case VD_AGENT_FILE_XFER_STATUS: {
@@ -383,13 +688,50 @@ static void do_client_file_xfer(struct vdagent_virtio_port *vport,
         g_return_if_reached(); /* quiet uninitialized variable warning */
     }
 
-    conn = g_hash_table_lookup(active_xfers, GUINT_TO_POINTER(id));
-    if (!conn) {
+    xfer = g_hash_table_lookup(active_xfers, GUINT_TO_POINTER(id));
+    if (!xfer) {
         if (debug)
             syslog(LOG_DEBUG, "Could not find file-xfer %u (cancelled?)", id);
         return;
     }
-    udscs_write(conn, msg_type, 0, 0, data, message_header->size);
+
+    if (msg_type == VDAGENTD_FILE_XFER_DATA && xfer->use_pipe) {
+        VDAgentFileXferDataMessage *d = (VDAgentFileXferDataMessage *)data;
+        if (d->size > message_header->size - sizeof(*d)) {
+            syslog(LOG_ERR, "file-xfer %u data size too large", id);
+            return;
+        }
+        if (xfer->pipe_fd == -1 || d->size == 0)
+            return;
+        /* Write the data straight from the message to the pipe, only when
+           the pipe is full the message buffer is taken over for the rest */
+        n = 0;
+        if (g_queue_is_empty(&xfer->backlog)) {
+            n = active_xfer_write_pipe(xfer, d->data, d->size);
+            if (n < 0 || (uint64_t)n == d->size)
+                return;
+        }
+        active_xfer_send(vport, xfer,
+                         virtio_steal_message_data(vport, message_header,
+                                                   data, d->data + n,
+                                                   d->size - n));
+        return;
+    }
+
+    bytes = virtio_steal_message_data(vport, message_header, data, data,
+                                      message_header->size);
+    if (msg_type == VDAGENTD_FILE_XFER_DATA) {
+        active_xfer_send(vport, xfer, bytes);
+        return;
+    }
+
+    udscs_write_bytes(xfer->conn, msg_type, 0, 0, bytes);
+    g_bytes_unref(bytes);
+
+    /* The client cancelled the file-xfer, or reported an error */
+    if (((VDAgentFileXferStatusMessage *)data)->result !=
+            VD_AGENT_FILE_XFER_STATUS_CAN_SEND_DATA)
+        g_hash_table_remove(active_xfers, GUINT_TO_POINTER(id));
 }
 
 static gsize vdagent_message_min_size[] =
@@ -521,6 +863,51 @@ static gboolean vdagent_message_check_size(const VDAgentMessage *message_header)
     return TRUE;
 }
 
+/* The stream callback of the virtio port, this takes over the
+   VD_AGENT_FILE_XFER_DATA messages of file-xfers using a pipe, so that
+   their data does not get copied into a message buffer first */
+static int virtio_port_stream_data(struct vdagent_virtio_port *vport,
+                                   int port_nr,
+                                   VDAgentMessage *message_header,
+                                   const uint8_t *data,
+                                   uint32_t offset, uint32_t size)
+{
+    VDAgentFileXferDataMessage d;
+    struct active_xfer *xfer;
+
+    if (offset == 0) {
+        if (port_nr != VDP_CLIENT_PORT ||
+                message_header->protocol != VD_AGENT_PROTOCOL ||
+                message_header->type != VD_AGENT_FILE_XFER_DATA ||
+                size < sizeof(d))
+            return 0;
+
+        memcpy(&d, data, sizeof(d));
+        d.id = GUINT32_FROM_LE(d.id);
+        d.size = GUINT64_FROM_LE(d.size);
+        xfer = g_hash_table_lookup(active_xfers, GUINT_TO_POINTER(d.id));
+        /* Anything unusual is left to do_client_file_xfer() */
+        if (!xfer || !xfer->use_pipe ||
+                d.size > message_header->size - sizeof(d) ||
+                !g_queue_is_empty(&xfer->backlog))
+            return 0;
+
+        streamed_xfer_id = d.id;
+        streamed_xfer_remaining = d.size;
+        data += sizeof(d);
+        size -= sizeof(d);
+    }
+
+    size = MIN(size, streamed_xfer_remaining);
+    streamed_xfer_remaining -= size;
+    /* The file-xfer may have been cancelled in the mean time */
+    xfer = g_hash_table_lookup(active_xfers,
+                               GUINT_TO_POINTER(streamed_xfer_id));
+    if (xfer)
+        active_xfer_stream(vport, xfer, data, size);
+    return 1;
+}
+
 static int virtio_port_read_complete(
         struct vdagent_virtio_port *vport,
         int port_nr,
@@ -582,8 +969,11 @@ static int virtio_port_read_complete(
     return 0;
 }
 
-static void virtio_write_clipboard(uint8_t selection, uint32_t msg_type,
-    uint32_t data_type, uint8_t *data, uint32_t data_size)
+/* Start a clipboard message, if fd is not -1 the last fd_size bytes of
+   data_size get read from it by the virtio port, which takes ownership of fd.
+   Returns 0 on success -1 on error */
+static int virtio_write_clipboard_start(uint8_t selection, uint32_t msg_type,
+    uint32_t data_type, uint32_t data_size, int fd, uint32_t fd_size)
 {
     uint32_t size = data_size;
 
@@ -595,8 +985,9 @@ static void virtio_write_clipboard(uint8_t selection, uint32_t msg_type,
         size += 4;
     }
 
-    vdagent_virtio_port_write_start(virtio_port, VDP_CLIENT_PORT, msg_type,
-                                    0, size);
+    if (vdagent_virtio_port_write_start_fd(virtio_port, VDP_CLIENT_PORT,
+                                           msg_type, 0, size, fd, fd_size))
+        return -1;
 
     if (VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
                                 VD_AGENT_CAP_CLIPBOARD_SELECTION)) {
@@ -608,11 +999,165 @@ static void virtio_write_clipboard(uint8_t selection, uint32_t msg_type,
         vdagent_virtio_port_write_append(virtio_port, (uint8_t*)&data_type, 4);
     }
 
+    return 0;
+}
+
+static void virtio_write_clipboard(uint8_t selection, uint32_t msg_type,
+    uint32_t data_type, uint8_t *data, uint32_t data_size)
+{
+    if (virtio_write_clipboard_start(selection, msg_type, data_type,
+                                     data_size, -1, 0))
+        return;
+
     if (msg_type == VD_AGENT_CLIPBOARD_GRAB)
         virtio_msg_uint32_to_le(data, data_size, 0);
     vdagent_virtio_port_write_append(virtio_port, data, data_size);
 }
 
+/* Returns an unlinked temporary file for large clipboard data, or -1 */
+/* Create a spool file for clipboard data. The clipboard may hold secrets,
+   so it must not end up on persistent storage, nor be accessible to anyone
+   but us: it goes into a memfd, or else into an O_TMPFILE file, which has
+   no name, in our own run-time directory, which is on tmpfs. */
+static int open_clipboard_spool_file(void)
+{
+    int fd = -1;
+
+#ifdef HAVE_MEMFD_CREATE
+    fd = memfd_create("spice-vdagentd-clipboard", MFD_CLOEXEC);
+#endif
+    if (fd == -1)
+        fd = open(AGENT_CLIPBOARD_SPOOL_DIR, O_TMPFILE | O_RDWR | O_CLOEXEC,
+                  S_IRUSR | S_IWUSR);
+    if (fd == -1)
+        syslog(LOG_ERR, "creating clipboard spool file: %m");
+    return fd;
+}
+
+/* Return value: the maximum size of clipboard data sent to the client */
+static uint32_t agent_clipboard_max_size(void)
+{
+    if (max_clipboard != -1)
+        return max_clipboard;
+    return AGENT_CLIPBOARD_DEFAULT_MAX_SIZE;
+}
+
+static void clear_agent_clipboard_chunks(struct agent_clipboard_chunks *chunks)
+{
+    if (chunks->data)
+        g_byte_array_free(chunks->data, TRUE);
+    chunks->data = NULL;
+    if (chunks->spool_fd != -1)
+        close(chunks->spool_fd);
+    chunks->spool_fd = -1;
+    chunks->size = 0;
+}
+
+static void free_agent_clipboard_chunks(uint8_t selection)
+{
+    if (!agent_clipboard_chunks[selection])
+        return;
+
+    clear_agent_clipboard_chunks(agent_clipboard_chunks[selection]);
+    g_free(agent_clipboard_chunks[selection]);
+    agent_clipboard_chunks[selection] = NULL;
+}
+
+static struct agent_clipboard_chunks *get_agent_clipboard_chunks(
+    uint8_t selection, uint32_t size_hint)
+{
+    struct agent_clipboard_chunks *chunks = agent_clipboard_chunks[selection];
+
+    if (!chunks) {
+        chunks = g_new0(struct agent_clipboard_chunks, 1);
+        chunks->data = g_byte_array_sized_new(MIN(size_hint,
+                                                  AGENT_CLIPBOARD_SPOOL_SIZE));
+        chunks->spool_fd = -1;
+        agent_clipboard_chunks[selection] = chunks;
+    }
+    return chunks;
+}
+
+/* Drop the data received so far and any chunks still to come */
+static void discard_agent_clipboard_chunks(uint8_t selection)
+{
+    struct agent_clipboard_chunks *chunks;
+
+    chunks = get_agent_clipboard_chunks(selection, 0);
+    clear_agent_clipboard_chunks(chunks);
+    chunks->discard = 1;
+}
+
+static int spool_agent_clipboard_data(struct agent_clipboard_chunks *chunks,
+                                      const uint8_t *data, uint32_t size)
+{
+    ssize_t n;
+
+    while (size) {
+        n = write(chunks->spool_fd, data, size);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            syslog(LOG_ERR, "writing clipboard spool file: %m");
+            return -1;
+        }
+        data += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static int start_agent_clipboard_spool(struct agent_clipboard_chunks *chunks)
+{
+    chunks->spool_fd = open_clipboard_spool_file();
+    if (chunks->spool_fd == -1)
+        return -1;
+
+    if (spool_agent_clipboard_data(chunks, chunks->data->data,
+                                   chunks->data->len))
+        return -1;
+
+    g_byte_array_free(chunks->data, TRUE);
+    chunks->data = NULL;
+    return 0;
+}
+
+/* Returns 0 if the data was added, -1 if the data is being discarded */
+static int add_agent_clipboard_chunk(uint8_t selection, uint32_t size_hint,
+                                     uint8_t *data, uint32_t size)
+{
+    struct agent_clipboard_chunks *chunks;
+
+    chunks = get_agent_clipboard_chunks(selection, MAX(size_hint, size));
+    if (chunks->discard)
+        return -1;
+
+    /* Check the size before spooling the data, so that the spool file
+       never grows beyond the maximum */
+    if (size_hint > agent_clipboard_max_size() ||
+            size > agent_clipboard_max_size() - chunks->size) {
+        syslog(LOG_WARNING, "clipboard is too large (> %u), discarding",
+               agent_clipboard_max_size());
+        goto discard;
+    }
+
+    if (chunks->data && chunks->size + size > AGENT_CLIPBOARD_SPOOL_SIZE &&
+            start_agent_clipboard_spool(chunks))
+        goto discard;
+
+    if (chunks->data)
+        g_byte_array_append(chunks->data, data, size);
+    else if (spool_agent_clipboard_data(chunks, data, size))
+        goto discard;
+
+    chunks->size += size;
+    return 0;
+
+discard:
+    discard_agent_clipboard_chunks(selection);
+    return -1;
+}
+
 /* vdagentd <-> vdagent communication handling */
 static int do_agent_clipboard(struct udscs_connection *conn,
         struct udscs_message_header *header, uint8_t *data)
@@ -653,9 +1198,34 @@ static int do_agent_clipboard(struct udscs_connection *conn,
         data_type = header->arg2;
         size = 0;
         break;
+    case VDAGENTD_CLIPBOARD_DATA_CHUNK:
+        add_agent_clipboard_chunk(selection, header->arg2, data, size);
+        return 0;
     case VDAGENTD_CLIPBOARD_DATA:
         msg_type = VD_AGENT_CLIPBOARD;
         data_type = header->arg2;
+        if (agent_clipboard_chunks[selection]) {
+            struct agent_clipboard_chunks *chunks;
+
+            /* This is the last part of chunked data */
+            chunks = agent_clipboard_chunks[selection];
+            if (data_type == VD_AGENT_CLIPBOARD_NONE ||
+                    add_agent_clipboard_chunk(selection, 0, data, size)) {
+                virtio_write_clipboard(selection, msg_type, data_type,
+                                       NULL, 0);
+            } else if (chunks->data) {
+                virtio_write_clipboard(selection, msg_type, data_type,
+                                       chunks->data->data, chunks->data->len);
+            } else {
+                /* The port closes the spool file when it is done with it */
+                virtio_write_clipboard_start(selection, msg_type, data_type,
+                                             chunks->size, chunks->spool_fd,
+                                             chunks->size);
+                chunks->spool_fd = -1;
+            }
+            free_agent_clipboard_chunks(selection);
+            return 0;
+        }
         if (max_clipboard != -1 && size > max_clipboard) {
             syslog(LOG_WARNING, "clipboard is too large (%d > %d), discarding",
                    size, max_clipboard);
@@ -689,9 +1259,150 @@ error:
         udscs_write(conn, VDAGENTD_CLIPBOARD_DATA,
                     selection, VD_AGENT_CLIPBOARD_NONE, NULL, 0);
     }
+    if (conn == active_session_conn) {
+        /* Don't pass on chunked data with a part missing */
+        if (header->type == VDAGENTD_CLIPBOARD_DATA_CHUNK)
+            discard_agent_clipboard_chunks(selection);
+        else if (header->type == VDAGENTD_CLIPBOARD_DATA)
+            free_agent_clipboard_chunks(selection);
+    }
     return 0;
 }
 
+static void virtio_port_event(void *opaque, uint32_t events);
+
+/* Open the vdagent virtio channel and register it with the event loop */
+static struct vdagent_virtio_port *virtio_port_open(void)
+{
+    struct vdagent_virtio_port *vport;
+
+    vport = vdagent_virtio_port_create(portdev, virtio_port_read_complete,
+                                       NULL);
+    if (vport) {
+        vdagent_virtio_port_set_read_buffer_size(vport, virtio_read_buf_size);
+        vdagent_virtio_port_set_stream_callback(vport,
+                                                virtio_port_stream_data);
+    }
+    if (vport && vdagent_virtio_port_attach_event_loop(vport, event_loop,
+                                                       virtio_port_event,
+                                                       NULL))
+        vdagent_virtio_port_destroy(&vport);
+
+    return vport;
+}
+
+/* Flush any pending writes and close the vdagent virtio channel */
+static void virtio_port_close(void)
+{
+    unsigned long calls, msgs;
+    unsigned int max_depth;
+
+    if (debug && virtio_port) {
+        vdagent_virtio_port_get_write_stats(virtio_port, &calls, &msgs);
+        vdagent_virtio_port_get_write_queue_stats(virtio_port, NULL, NULL,
+                                                  &max_depth);
+        syslog(LOG_DEBUG, "virtio port: %lu messages in %lu writes, "
+               "write queue max depth: %u", msgs, calls, max_depth);
+    }
+
+    vdagent_virtio_port_flush(&virtio_port);
+    vdagent_virtio_port_destroy(&virtio_port);
+}
+
+static void virtio_port_event(void *opaque, uint32_t events)
+{
+    int old_client_connected = client_connected;
+
+    vdagent_virtio_port_handle_events(&virtio_port, events);
+    if (virtio_port)
+        return;
+
+    syslog(LOG_CRIT, "AIIEEE lost spice client connection, reconnecting");
+    virtio_port = virtio_port_open();
+    if (!virtio_port) {
+        syslog(LOG_CRIT, "Fatal error opening vdagent virtio channel");
+        retval = 1;
+        quit = 1;
+        return;
+    }
+    do_client_disconnect();
+    client_connected = old_client_connected;
+}
+
+static void active_xfer_flush_messages(gpointer key, gpointer value,
+                                       gpointer user_data)
+{
+    struct active_xfer *xfer = value;
+
+    if (!xfer->use_pipe && !g_queue_is_empty(&xfer->backlog))
+        active_xfer_flush(xfer);
+}
+
+/* Pass on the backlogs of the file-xfers sent as messages once the agents
+   accept more, and resume reading from the virtio port once the backlogs of
+   all file-xfers have shrunk enough */
+static void virtio_port_check_throttle(void)
+{
+    if (file_xfer_backlog_size)
+        g_hash_table_foreach(active_xfers, active_xfer_flush_messages, NULL);
+
+    if (!virtio_port_throttled ||
+            file_xfer_backlog_size > FILE_XFER_BACKLOG_SIZE / 2)
+        return;
+
+    virtio_port_throttled = 0;
+    if (!virtio_port)
+        return;
+
+    if (debug)
+        syslog(LOG_DEBUG, "agent caught up, unthrottling client");
+    vdagent_virtio_port_set_read_paused(virtio_port, 0);
+    /* The port is edge-triggered, read what has arrived in the mean time */
+    virtio_port_event(NULL, EPOLLIN);
+}
+
+/* Stop reading from an agent while the client is not keeping up with the
+   clipboard data and file-xfer statuses we send it, rather than queueing
+   up an unbounded amount of data for the virtio port */
+static void agent_check_throttle(struct udscs_connection **connp)
+{
+    struct agent_data *agent_data = udscs_get_user_data(*connp);
+
+    if (!virtio_port || !vdagent_virtio_port_write_queue_full(virtio_port))
+        return;
+
+    if (debug && !agent_data->read_paused)
+        syslog(LOG_DEBUG, "client is not keeping up, throttling agent");
+    agent_data->read_paused = 1;
+    agents_throttled = 1;
+    udscs_set_read_paused(connp, 1);
+}
+
+static int agent_resume_read(struct udscs_connection **connp, void *priv)
+{
+    struct agent_data *agent_data = udscs_get_user_data(*connp);
+
+    if (agent_data && agent_data->read_paused) {
+        agent_data->read_paused = 0;
+        udscs_set_read_paused(connp, 0);
+    }
+    return 0;
+}
+
+/* Resume reading from the agents once the virtio port has caught up */
+static void agents_check_throttle(void)
+{
+    if (!agents_throttled)
+        return;
+    if (virtio_port && vdagent_virtio_port_write_queue_full(virtio_port))
+        return;
+
+    if (debug)
+        syslog(LOG_DEBUG, "client caught up, unthrottling agents");
+    agents_throttled = 0;
+    udscs_server_for_all_clients(server, agent_resume_read, NULL);
+}
+
 /* When we open the vdagent virtio channel, the server automatically goes into
    client mouse mode, so we can only have the channel open when we know the
    active session resolution. This function checks that we have an agent in the
@@ -727,9 +1438,7 @@ static void check_xorg_resolution(void)
 
         if (!virtio_port) {
             syslog(LOG_INFO, "opening vdagent virtio channel");
-            virtio_port = vdagent_virtio_port_create(portdev,
-                                                     virtio_port_read_complete,
-                                                     NULL);
+            virtio_port = virtio_port_open();
             if (!virtio_port) {
                 syslog(LOG_CRIT, "Fatal error opening vdagent virtio channel");
                 retval = 1;
@@ -743,8 +1452,7 @@ static void check_xorg_resolution(void)
         vdagentd_uinput_destroy(&uinput);
 #endif
         if (virtio_port) {
-            vdagent_virtio_port_flush(&virtio_port);
-            vdagent_virtio_port_destroy(&virtio_port);
+            virtio_port_close();
             syslog(LOG_INFO, "closed vdagent virtio channel");
         }
     }
@@ -769,6 +1477,7 @@ static int connection_matches_active_session(struct udscs_connection **connp,
 static void release_clipboards(void)
 {
     uint8_t sel;
+    int i;
 
     for (sel = 0; sel < VD_AGENT_CLIPBOARD_SELECTION_SECONDARY; ++sel) {
         if (agent_owns_clipboard[sel] && virtio_port) {
@@ -777,6 +1486,9 @@ static void release_clipboards(void)
         }
         agent_owns_clipboard[sel] = 0;
     }
+
+    for (i = 0; i < G_N_ELEMENTS(agent_clipboard_chunks); i++)
+        free_agent_clipboard_chunks(i);
 }
 
 static void update_active_session_connection(struct udscs_connection *new_conn)
@@ -830,7 +1542,9 @@ static void update_active_session_connection(struct udscs_connection *new_conn)
 
 static gboolean remove_active_xfers(gpointer key, gpointer value, gpointer conn)
 {
-    if (value == conn) {
+    struct active_xfer *xfer = value;
+
+    if (xfer->conn == conn) {
         send_file_xfer_status(virtio_port,
                               "Agent disc; cancelling file-xfer %u",
                               GPOINTER_TO_UINT(key),
@@ -920,11 +1634,13 @@ static void agent_read_complete(struct udscs_connection **connp,
     case VDAGENTD_CLIPBOARD_GRAB:
     case VDAGENTD_CLIPBOARD_REQUEST:
     case VDAGENTD_CLIPBOARD_DATA:
+    case VDAGENTD_CLIPBOARD_DATA_CHUNK:
     case VDAGENTD_CLIPBOARD_RELEASE:
         if (do_agent_clipboard(*connp, header, data)) {
             udscs_destroy_connection(connp);
             return;
         }
+        agent_check_throttle(connp);
         break;
     case VDAGENTD_FILE_XFER_STATUS:{
         /* header->arg1 = file xfer task id, header->arg2 = file xfer status */
@@ -940,15 +1656,21 @@ static void agent_read_complete(struct udscs_connection **connp,
                 send_file_xfer_status(virtio_port, "File-xfer is disabled, cancelling",
                                       header->arg1, header->arg2, NULL, 0);
                 break;
+            case VD_AGENT_FILE_XFER_STATUS_SUCCESS:
+                /* Pass on the digest of the file, which the agent only
+                   sends when enabled with -c. There is no capability for
+                   it, clients not knowing about it ignore the extra data */
+                send_file_xfer_status(virtio_port, NULL, header->arg1,
+                                      header->arg2, data, header->size);
+                break;
             default:
                 send_file_xfer_status(virtio_port, NULL, header->arg1, header->arg2, NULL, 0);
         }
 
-        if (header->arg2 == VD_AGENT_FILE_XFER_STATUS_CAN_SEND_DATA)
-            g_hash_table_insert(active_xfers, GUINT_TO_POINTER(GUINT32_TO_LE(header->arg1)),
-                                *connp);
-        else
+        /* The file-xfer got added to active_xfers when it was started */
+        if (header->arg2 != VD_AGENT_FILE_XFER_STATUS_CAN_SEND_DATA)
             g_hash_table_remove(active_xfers, GUINT_TO_POINTER(GUINT32_TO_LE(header->arg1)));
+        agent_check_throttle(connp);
         break;
     }
 
@@ -969,6 +1691,8 @@ static void usage(FILE *fp)
             "  -h             print this text\n"
             "  -d             log debug messages (use twice for extra info)\n"
             "  -s <port>      set virtio serial port  [%s]\n"
+            "  -b <bytes>     set virtio serial port read buffer size [%d]\n"
+            "                 0 reads a single chunk at a time\n"
             "  -S <filename>  set vdagent Unix domain socket [%s]\n"
             "  -u <dev>       set uinput device       [%s]\n"
             "  -f             treat uinput device as fake; no ioctls\n"
@@ -980,7 +1704,8 @@ static void usage(FILE *fp)
 #ifdef HAVE_LIBSYSTEMD_LOGIN
             "  -X             disable systemd-logind integration\n"
 #endif
-            ,VERSION, portdev, vdagentd_socket, uinput_device);
+            ,VERSION, portdev, VIRTIO_PORT_DEFAULT_READ_BUF_SIZE,
+            vdagentd_socket, uinput_device);
 }
 
 static void daemonize(void)
@@ -1009,70 +1734,31 @@ static void daemonize(void)
     }
 }
 
+static void session_info_event(void *opaque, uint32_t events)
+{
+    active_session = session_info_get_active_session(session_info);
+    update_active_session_connection(NULL);
+}
+
 static void main_loop(void)
 {
-    fd_set readfds, writefds;
-    int n, nfds;
-    int ck_fd = 0;
     int once = 0;
 
     while (!quit) {
-        FD_ZERO(&readfds);
-        FD_ZERO(&writefds);
-
-        nfds = udscs_server_fill_fds(server, &readfds, &writefds);
-        n = vdagent_virtio_port_fill_fds(virtio_port, &readfds, &writefds);
-        if (n >= nfds)
-            nfds = n + 1;
-
-        if (session_info) {
-            ck_fd = session_info_get_fd(session_info);
-            FD_SET(ck_fd, &readfds);
-            if (ck_fd >= nfds)
-                nfds = ck_fd + 1;
-        }
-
-        n = select(nfds, &readfds, &writefds, NULL, NULL);
-        if (n == -1) {
-            if (errno == EINTR)
-                continue;
-            syslog(LOG_CRIT, "Fatal error select: %m");
+        if (vdagentd_event_loop_iterate(event_loop) == -1) {
             retval = 1;
             break;
         }
+        virtio_port_check_throttle();
+        agents_check_throttle();
 
-        udscs_server_handle_fds(server, &readfds, &writefds);
-
-        if (virtio_port) {
+        if (virtio_port)
             once = 1;
-            vdagent_virtio_port_handle_fds(&virtio_port, &readfds, &writefds);
-            if (!virtio_port) {
-                int old_client_connected = client_connected;
-                syslog(LOG_CRIT,
-                       "AIIEEE lost spice client connection, reconnecting");
-                virtio_port = vdagent_virtio_port_create(portdev,
-                                                     virtio_port_read_complete,
-                                                     NULL);
-                if (!virtio_port) {
-                    syslog(LOG_CRIT,
-                           "Fatal error opening vdagent virtio channel");
-                    retval = 1;
-                    break;
-                }
-                do_client_disconnect();
-                client_connected = old_client_connected;
-            }
-        }
         else if (only_once && once)
         {
             syslog(LOG_INFO, "Exiting after one client session.");
             break;
         }
-
-        if (session_info && FD_ISSET(ck_fd, &readfds)) {
-            active_session = session_info_get_active_session(session_info);
-            update_active_session_connection(NULL);
-        }
     }
 }
 
@@ -1090,7 +1776,7 @@ int main(int argc, char *argv[])
     gboolean own_socket = TRUE;
 
     for (;;) {
-        if (-1 == (c = getopt(argc, argv, "-dhxXfos:u:S:")))
+        if (-1 == (c = getopt(argc, argv, "-dhxXfos:b:u:S:")))
             break;
         switch (c) {
         case 'd':
@@ -1099,6 +1785,13 @@ int main(int argc, char *argv[])
         case 's':
             portdev = optarg;
             break;
+        case 'b':
+            virtio_read_buf_size = atoi(optarg);
+            if (virtio_read_buf_size < 0) {
+                fprintf(stderr, "Invalid read buffer size: %s\n", optarg);
+                return 1;
+            }
+            break;
         case 'S':
             vdagentd_socket = optarg;
             break;
@@ -1134,6 +1827,9 @@ int main(int argc, char *argv[])
     sigaction(SIGHUP, &act, NULL);
     sigaction(SIGTERM, &act, NULL);
     sigaction(SIGQUIT, &act, NULL);
+    /* Writing to a file-xfer pipe closed by the agent must not kill us */
+    act.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &act, NULL);
 
     openlog("spice-vdagentd", do_daemonize ? 0 : LOG_PERROR, LOG_USER);
 
@@ -1197,21 +1893,42 @@ int main(int argc, char *argv[])
     }
 #endif
 
+    event_loop = vdagentd_event_loop_create();
+    if (!event_loop || udscs_server_attach_event_loop(server, event_loop)) {
+        syslog(LOG_CRIT, "Fatal could not set up the event loop");
+        vdagentd_uinput_destroy(&uinput);
+        udscs_destroy_server(server);
+        vdagentd_event_loop_destroy(event_loop);
+        return 1;
+    }
+
     if (want_session_info)
         session_info = session_info_create(debug);
     if (!session_info)
         syslog(LOG_WARNING, "no session info, max 1 session agent allowed");
+    else {
+        /* Level-triggered, the session_info backends only consume
+           the pending notifications they are interested in */
+        session_info_watch = vdagentd_event_loop_add_watch(event_loop,
+                                        session_info_get_fd(session_info),
+                                        EPOLLIN, session_info_event, NULL);
+        if (!session_info_watch)
+            syslog(LOG_WARNING, "could not watch session info changes");
+    }
 
-    active_xfers = g_hash_table_new(g_direct_hash, g_direct_equal);
+    active_xfers = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                         NULL, active_xfer_free);
     main_loop();
+    g_hash_table_destroy(active_xfers);
 
     release_clipboards();
 
     vdagentd_uinput_destroy(&uinput);
-    vdagent_virtio_port_flush(&virtio_port);
-    vdagent_virtio_port_destroy(&virtio_port);
+    virtio_port_close();
+    vdagentd_event_loop_remove_watch(session_info_watch);
     session_info_destroy(session_info);
     udscs_destroy_server(server);
+    vdagentd_event_loop_destroy(event_loop);
 
     /* leave the socket around if it was provided by systemd */
     if (own_socket) {
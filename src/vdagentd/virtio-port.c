@@ -19,18 +19,25 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <sys/select.h>
+#include <limits.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <glib.h>
 
 #include "virtio-port.h"
+#include "event-loop.h"
 
 
 struct vdagent_virtio_port_buf {
@@ -38,6 +45,11 @@ struct vdagent_virtio_port_buf {
     size_t pos;
     size_t size;
     size_t write_pos;
+    /* When fd is not -1 the last fd_size bytes of the message are read
+       from fd a bit at a time, once buf has been written */
+    int fd;
+    size_t fd_pos;
+    size_t fd_size;
 
     struct vdagent_virtio_port_buf *next;
 };
@@ -49,6 +61,8 @@ struct vdagent_virtio_port_chunk_port_data {
     int message_data_pos;
     VDAgentMessage message_header;
     uint8_t *message_data;
+    /* The data of the message is passed to the stream callback */
+    int message_streamed;
 };
 
 struct vdagent_virtio_port {
@@ -61,21 +75,49 @@ struct vdagent_virtio_port {
     int chunk_data_pos;
     VDIChunkHeader chunk_header;
     uint8_t chunk_data[VD_AGENT_MAX_DATA_SIZE];
+    /* The data of the current chunk is read directly into the message_data
+       of its chunk port */
+    int chunk_direct;
+
+    /* Large-read mode, when read_buf_size is not 0 as much data as
+       available is read into read_buf, and all complete chunks in it are
+       processed in one go. read_buf holds unprocessed data from read_start
+       till read_end. */
+    uint8_t *read_buf;
+    size_t read_buf_size;
+    size_t read_start;
+    size_t read_end;
 
     /* Per chunk port data */
     struct vdagent_virtio_port_chunk_port_data port_data[VDP_END_PORT];
+    /* The data of the message being passed to the read callback, until it
+       gets claimed with vdagent_virtio_port_steal_data() */
+    uint8_t *read_data;
 
     /* Writes are stored in a linked list of buffers, with both the header
        + data for a single message in 1 buffer. */
     struct vdagent_virtio_port_buf *write_buf;
+    struct vdagent_virtio_port_buf *write_buf_tail;
+    unsigned int write_buf_depth;
+    unsigned int write_buf_max_depth;
+    size_t write_buf_bytes;
+    int write_queue_full;
+    /* Number of write syscalls done and messages completed by them */
+    unsigned long write_calls;
+    unsigned long write_msgs;
+
+    int read_paused;
+
+    struct vdagentd_event_watch *watch;
 
     /* Callbacks */
     vdagent_virtio_port_read_callback read_callback;
     vdagent_virtio_port_disconnect_callback disconnect_callback;
+    vdagent_virtio_port_stream_callback stream_callback;
 };
 
-static void vdagent_virtio_port_do_write(struct vdagent_virtio_port **vportp);
-static void vdagent_virtio_port_do_read(struct vdagent_virtio_port **vportp);
+static int vdagent_virtio_port_do_write(struct vdagent_virtio_port **vportp);
+static int vdagent_virtio_port_do_read(struct vdagent_virtio_port **vportp);
 
 struct vdagent_virtio_port *vdagent_virtio_port_create(const char *portname,
     vdagent_virtio_port_read_callback read_callback,
@@ -83,13 +125,13 @@ struct vdagent_virtio_port *vdagent_virtio_port_create(const char *portname,
 {
     struct vdagent_virtio_port *vport;
     struct sockaddr_un address;
-    int c;
+    int c, flags;
 
     vport = calloc(1, sizeof(*vport));
     if (!vport)
         return 0;
 
-    vport->fd = open(portname, O_RDWR);
+    vport->fd = open(portname, O_RDWR | O_NONBLOCK);
     if (vport->fd == -1) {
         vport->fd = socket(PF_UNIX, SOCK_STREAM, 0);
         if (vport->fd == -1) {
@@ -103,10 +145,17 @@ struct vdagent_virtio_port *vdagent_virtio_port_create(const char *portname,
         } else {
             goto error;
         }
+        /* The port is read edge-triggered, so it must not block */
+        flags = fcntl(vport->fd, F_GETFL);
+        if (flags == -1 ||
+                fcntl(vport->fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+            goto error;
+        }
     } else {
         vport->is_uds = 0;
     }
     vport->opening = 1;
+    vport->read_buf_size = VIRTIO_PORT_DEFAULT_READ_BUF_SIZE;
 
     vport->read_callback = read_callback;
     vport->disconnect_callback = disconnect_callback;
@@ -137,6 +186,8 @@ void vdagent_virtio_port_destroy(struct vdagent_virtio_port **vportp)
     wbuf = vport->write_buf;
     while (wbuf) {
         next_wbuf = wbuf->next;
+        if (wbuf->fd != -1)
+            close(wbuf->fd);
         free(wbuf->buf);
         free(wbuf);
         wbuf = next_wbuf;
@@ -145,51 +196,124 @@ void vdagent_virtio_port_destroy(struct vdagent_virtio_port **vportp)
     for (i = 0; i < VDP_END_PORT; i++) {
         free(vport->port_data[i].message_data);
     }
+    free(vport->read_buf);
 
+    vdagentd_event_loop_remove_watch(vport->watch);
     close(vport->fd);
     free(vport);
     *vportp = NULL;
 }
 
-int vdagent_virtio_port_fill_fds(struct vdagent_virtio_port *vport,
-        fd_set *readfds, fd_set *writefds)
+void vdagent_virtio_port_set_read_buffer_size(
+        struct vdagent_virtio_port *vport, size_t size)
 {
-    if (!vport)
-        return -1;
+    /* The buffer must be able to hold at least a single complete chunk */
+    if (size && size < sizeof(VDIChunkHeader) + VD_AGENT_MAX_DATA_SIZE)
+        size = sizeof(VDIChunkHeader) + VD_AGENT_MAX_DATA_SIZE;
+
+    vport->read_buf_size = size;
+}
+
+void vdagent_virtio_port_set_stream_callback(
+        struct vdagent_virtio_port *vport,
+        vdagent_virtio_port_stream_callback stream_callback)
+{
+    vport->stream_callback = stream_callback;
+}
+
+int vdagent_virtio_port_attach_event_loop(struct vdagent_virtio_port *vport,
+        struct vdagentd_event_loop *loop,
+        vdagentd_event_callback callback, void *opaque)
+{
+    uint32_t events = EPOLLIN | EPOLLET;
 
-    FD_SET(vport->fd, readfds);
     if (vport->write_buf)
-        FD_SET(vport->fd, writefds);
+        events |= EPOLLOUT;
+
+    vport->watch = vdagentd_event_loop_add_watch(loop, vport->fd, events,
+                                                 callback, opaque);
+    if (!vport->watch)
+        return -1;
 
-    return vport->fd + 1;
+    return 0;
 }
 
-void vdagent_virtio_port_handle_fds(struct vdagent_virtio_port **vportp,
-        fd_set *readfds, fd_set *writefds)
+void vdagent_virtio_port_handle_events(struct vdagent_virtio_port **vportp,
+        uint32_t events)
 {
     if (!*vportp)
         return;
 
-    if (FD_ISSET((*vportp)->fd, readfds))
-        vdagent_virtio_port_do_read(vportp);
+    /* The port is edge-triggered, so drain it until it would block, or
+       until reading gets paused by one of the read callbacks */
+    if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+        while (!(*vportp)->read_paused && vdagent_virtio_port_do_read(vportp))
+            ;
+    }
 
-    if (*vportp && FD_ISSET((*vportp)->fd, writefds))
-        vdagent_virtio_port_do_write(vportp);
+    if (*vportp && (events & EPOLLOUT) && (*vportp)->write_buf) {
+        while (vdagent_virtio_port_do_write(vportp))
+            ;
+        /* Stop watching for EPOLLOUT once everything has been sent */
+        if (*vportp && !(*vportp)->write_buf && (*vportp)->watch)
+            vdagentd_event_watch_set_events((*vportp)->watch,
+                                            EPOLLIN | EPOLLET);
+    }
 }
 
-static struct vdagent_virtio_port_buf* vdagent_virtio_port_get_last_wbuf(
-    struct vdagent_virtio_port *vport)
+void vdagent_virtio_port_get_write_stats(struct vdagent_virtio_port *vport,
+        unsigned long *calls, unsigned long *msgs)
 {
-    struct vdagent_virtio_port_buf *wbuf;
+    if (calls)
+        *calls = vport->write_calls;
+    if (msgs)
+        *msgs = vport->write_msgs;
+}
 
-    wbuf = vport->write_buf;
-    if (!wbuf)
+void vdagent_virtio_port_set_read_paused(struct vdagent_virtio_port *vport,
+        int paused)
+{
+    vport->read_paused = paused;
+}
+
+uint8_t *vdagent_virtio_port_steal_data(struct vdagent_virtio_port *vport)
+{
+    struct vdagent_virtio_port_chunk_port_data *port =
+        &vport->port_data[vport->chunk_header.port];
+    uint8_t *data;
+
+    if (!vport->read_data || !port->message_header.size)
         return NULL;
 
-    while (wbuf->next)
-        wbuf = wbuf->next;
+    if (vport->read_data == port->message_data) {
+        /* Messages spanning multiple chunks are assembled in a buffer of
+           their own */
+        data = port->message_data;
+        port->message_data = NULL;
+    } else {
+        data = malloc(port->message_header.size);
+        if (data)
+            memcpy(data, vport->read_data, port->message_header.size);
+    }
+    vport->read_data = NULL;
+    return data;
+}
 
-    return wbuf;
+int vdagent_virtio_port_write_queue_full(struct vdagent_virtio_port *vport)
+{
+    return vport->write_queue_full;
+}
+
+void vdagent_virtio_port_get_write_queue_stats(
+        struct vdagent_virtio_port *vport,
+        unsigned int *depth, size_t *bytes, unsigned int *max_depth)
+{
+    if (depth)
+        *depth = vport->write_buf_depth;
+    if (bytes)
+        *bytes = vport->write_buf_bytes;
+    if (max_depth)
+        *max_depth = vport->write_buf_max_depth;
 }
 
 int vdagent_virtio_port_write_start(
@@ -199,20 +323,43 @@ int vdagent_virtio_port_write_start(
         uint32_t message_opaque,
         uint32_t data_size)
 {
-    struct vdagent_virtio_port_buf *wbuf, *new_wbuf;
+    return vdagent_virtio_port_write_start_fd(vport, port_nr, message_type,
+                                              message_opaque, data_size,
+                                              -1, 0);
+}
+
+int vdagent_virtio_port_write_start_fd(
+        struct vdagent_virtio_port *vport,
+        uint32_t port_nr,
+        uint32_t message_type,
+        uint32_t message_opaque,
+        uint32_t data_size,
+        int fd,
+        uint32_t fd_size)
+{
+    struct vdagent_virtio_port_buf *new_wbuf;
     VDIChunkHeader chunk_header;
     VDAgentMessage message_header;
 
     new_wbuf = malloc(sizeof(*new_wbuf));
-    if (!new_wbuf)
+    if (!new_wbuf) {
+        if (fd != -1)
+            close(fd);
         return -1;
+    }
 
     new_wbuf->pos = 0;
     new_wbuf->write_pos = 0;
-    new_wbuf->size = sizeof(chunk_header) + sizeof(message_header) + data_size;
+    new_wbuf->size = sizeof(chunk_header) + sizeof(message_header) +
+                     data_size - fd_size;
+    new_wbuf->fd = fd;
+    new_wbuf->fd_pos = 0;
+    new_wbuf->fd_size = fd_size;
     new_wbuf->next = NULL;
     new_wbuf->buf = malloc(new_wbuf->size);
     if (!new_wbuf->buf) {
+        if (fd != -1)
+            close(fd);
         free(new_wbuf);
         return -1;
     }
@@ -231,13 +378,25 @@ int vdagent_virtio_port_write_start(
            sizeof(message_header));
     new_wbuf->write_pos += sizeof(message_header);
 
+    vport->write_buf_depth++;
+    if (vport->write_buf_depth > vport->write_buf_max_depth)
+        vport->write_buf_max_depth = vport->write_buf_depth;
+    vport->write_buf_bytes += new_wbuf->size;
+    if (vport->write_buf_bytes >= VIRTIO_PORT_WRITE_QUEUE_HIGH_WATER)
+        vport->write_queue_full = 1;
+
     if (!vport->write_buf) {
         vport->write_buf = new_wbuf;
+        vport->write_buf_tail = new_wbuf;
+        /* Re-arming EPOLLOUT makes epoll report the port if it is writable */
+        if (vport->watch)
+            vdagentd_event_watch_set_events(vport->watch,
+                                            EPOLLIN | EPOLLOUT | EPOLLET);
         return 0;
     }
 
-    wbuf = vdagent_virtio_port_get_last_wbuf(vport);
-    wbuf->next = new_wbuf;
+    vport->write_buf_tail->next = new_wbuf;
+    vport->write_buf_tail = new_wbuf;
 
     return 0;
 }
@@ -247,7 +406,7 @@ int vdagent_virtio_port_write_append(struct vdagent_virtio_port *vport,
 {
     struct vdagent_virtio_port_buf *wbuf;
 
-    wbuf = vdagent_virtio_port_get_last_wbuf(vport);
+    wbuf = vport->write_buf_tail;
     if (!wbuf) {
         syslog(LOG_ERR, "can't append without a buffer");
         return -1;
@@ -281,8 +440,26 @@ int vdagent_virtio_port_write(
 
 void vdagent_virtio_port_flush(struct vdagent_virtio_port **vportp)
 {
-    while (*vportp && (*vportp)->write_buf)
-        vdagent_virtio_port_do_write(vportp);
+    struct pollfd p;
+
+    while (*vportp && (*vportp)->write_buf) {
+        if (vdagent_virtio_port_do_write(vportp) || !*vportp ||
+                !(*vportp)->write_buf)
+            continue;
+
+        /* The port is non-blocking, wait for it to become writable */
+        p.fd = (*vportp)->fd;
+        p.events = POLLOUT;
+        if (poll(&p, 1, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            syslog(LOG_ERR, "flushing vdagent virtio port: %m");
+            return;
+        }
+        /* The host side is not connected, nothing will ever get written */
+        if (!(p.revents & POLLOUT) && (p.revents & (POLLHUP | POLLERR)))
+            return;
+    }
 }
 
 void vdagent_virtio_port_reset(struct vdagent_virtio_port *vport, int port)
@@ -295,41 +472,40 @@ void vdagent_virtio_port_reset(struct vdagent_virtio_port *vport, int port)
     memset(&vport->port_data[port], 0, sizeof(vport->port_data[0]));
 }
 
-static void vdagent_virtio_port_do_chunk(struct vdagent_virtio_port **vportp)
+static void vdagent_virtio_port_do_chunk(struct vdagent_virtio_port **vportp,
+    uint8_t *chunk_data)
 {
-    int avail, read, pos = 0;
+    int avail, read, pos = 0, r;
     struct vdagent_virtio_port *vport = *vportp;
     struct vdagent_virtio_port_chunk_port_data *port =
         &vport->port_data[vport->chunk_header.port];
+    uint8_t *data = port->message_data;
 
-    if (port->message_header_read < sizeof(port->message_header)) {
-        read = sizeof(port->message_header) - port->message_header_read;
-        if (read > vport->chunk_header.size) {
-            read = vport->chunk_header.size;
-        }
-        memcpy((uint8_t *)&port->message_header + port->message_header_read,
-               vport->chunk_data, read);
-        port->message_header_read += read;
-        if (port->message_header_read == sizeof(port->message_header)) {
-
-            port->message_header.protocol = GUINT32_FROM_LE(port->message_header.protocol);
-            port->message_header.type = GUINT32_FROM_LE(port->message_header.type);
-            port->message_header.opaque = GUINT64_FROM_LE(port->message_header.opaque);
-            port->message_header.size = GUINT32_FROM_LE(port->message_header.size);
-
-            if (port->message_header.size) {
-                port->message_data = malloc(port->message_header.size);
-                if (!port->message_data) {
-                    syslog(LOG_ERR, "out of memory, disconnecting virtio");
-                    vdagent_virtio_port_destroy(vportp);
-                    return;
-                }
+    if (vport->chunk_direct) {
+        /* The chunk has been read straight into the message buffer */
+        port->message_data_pos += vport->chunk_header.size;
+    } else {
+        if (port->message_header_read < sizeof(port->message_header)) {
+            read = sizeof(port->message_header) - port->message_header_read;
+            if (read > vport->chunk_header.size) {
+                read = vport->chunk_header.size;
+            }
+            memcpy((uint8_t *)&port->message_header + port->message_header_read,
+                   chunk_data, read);
+            port->message_header_read += read;
+            if (port->message_header_read == sizeof(port->message_header)) {
+
+                port->message_header.protocol = GUINT32_FROM_LE(port->message_header.protocol);
+                port->message_header.type = GUINT32_FROM_LE(port->message_header.type);
+                port->message_header.opaque = GUINT64_FROM_LE(port->message_header.opaque);
+                port->message_header.size = GUINT32_FROM_LE(port->message_header.size);
             }
+            pos = read;
         }
-        pos = read;
-    }
 
-    if (port->message_header_read == sizeof(port->message_header)) {
+        if (port->message_header_read < sizeof(port->message_header))
+            return;
+
         read  = port->message_header.size - port->message_data_pos;
         avail = vport->chunk_header.size - pos;
 
@@ -339,29 +515,80 @@ static void vdagent_virtio_port_do_chunk(struct vdagent_virtio_port **vportp)
             return;
         }
 
-        if (avail < read)
-            read = avail;
-
-        if (read) {
-            memcpy(port->message_data + port->message_data_pos,
-                   vport->chunk_data + pos, read);
-            port->message_data_pos += read;
+        /* Offer messages spanning multiple chunks to the stream callback,
+           which saves copying their data into a message buffer */
+        if (!port->message_data && !port->message_streamed &&
+                avail && avail < read && vport->stream_callback) {
+            r = vport->stream_callback(vport, vport->chunk_header.port,
+                                       &port->message_header,
+                                       chunk_data + pos, 0, avail);
+            if (r == -1) {
+                vdagent_virtio_port_destroy(vportp);
+                return;
+            }
+            if (r == 1) {
+                port->message_streamed = 1;
+                port->message_data_pos += avail;
+                avail = 0;
+            }
+        } else if (port->message_streamed && avail) {
+            r = vport->stream_callback(vport, vport->chunk_header.port,
+                                       &port->message_header,
+                                       chunk_data + pos,
+                                       port->message_data_pos, avail);
+            if (r == -1) {
+                vdagent_virtio_port_destroy(vportp);
+                return;
+            }
+            port->message_data_pos += avail;
+            avail = 0;
         }
 
-        if (port->message_data_pos == port->message_header.size) {
-            if (vport->read_callback) {
-                int r = vport->read_callback(vport, vport->chunk_header.port,
-                                 &port->message_header, port->message_data);
-                if (r == -1) {
+        if (port->message_streamed) {
+            /* Nothing to assemble */
+        } else if (!port->message_data && avail == read) {
+            /* The (common) single chunk case, no need to copy the data */
+            if (avail)
+                data = chunk_data + pos;
+        } else if (avail) {
+            /* Unless in large-read mode the data of any further chunks of
+               this message gets read directly into message_data by
+               vdagent_virtio_port_do_read(). In large-read mode the chunks
+               are copied from read_buf, as their data is interleaved with
+               chunk headers, reading it directly into message_data would
+               take a read() per chunk. Messages which are streamed avoid
+               this copy. */
+            if (!port->message_data) {
+                port->message_data = malloc(port->message_header.size);
+                if (!port->message_data) {
+                    syslog(LOG_ERR, "out of memory, disconnecting virtio");
                     vdagent_virtio_port_destroy(vportp);
                     return;
                 }
+                data = port->message_data;
+            }
+            memcpy(port->message_data + port->message_data_pos,
+                   chunk_data + pos, avail);
+        }
+        port->message_data_pos += avail;
+    }
+
+    if (port->message_data_pos == port->message_header.size) {
+        if (vport->read_callback && !port->message_streamed) {
+            vport->read_data = data;
+            r = vport->read_callback(vport, vport->chunk_header.port,
+                                     &port->message_header, data);
+            if (r == -1) {
+                vdagent_virtio_port_destroy(vportp);
+                return;
             }
-            port->message_header_read = 0;
-            port->message_data_pos = 0;
-            free(port->message_data);
-            port->message_data = NULL;
+            vport->read_data = NULL;
         }
+        port->message_header_read = 0;
+        port->message_data_pos = 0;
+        port->message_streamed = 0;
+        free(port->message_data);
+        port->message_data = NULL;
     }
 }
 
@@ -374,16 +601,111 @@ static int vport_read(struct vdagent_virtio_port *vport, uint8_t *buf, int len)
     }
 }
 
-static void vdagent_virtio_port_do_read(struct vdagent_virtio_port **vportp)
+/* A helper for vdagent_virtio_port_do_read(), converts the chunk header
+   to host endianness and checks it.
+   Return value: 0 on success, -1 if the port has been destroyed */
+static int vdagent_virtio_port_check_chunk_header(
+    struct vdagent_virtio_port **vportp)
+{
+    struct vdagent_virtio_port *vport = *vportp;
+
+    vport->chunk_header.size = GUINT32_FROM_LE(vport->chunk_header.size);
+    vport->chunk_header.port = GUINT32_FROM_LE(vport->chunk_header.port);
+    if (vport->chunk_header.size > VD_AGENT_MAX_DATA_SIZE) {
+        syslog(LOG_ERR, "chunk size %u too large",
+               vport->chunk_header.size);
+        vdagent_virtio_port_destroy(vportp);
+        return -1;
+    }
+    if (vport->chunk_header.port >= VDP_END_PORT) {
+        syslog(LOG_ERR, "chunk port %u out of range",
+               vport->chunk_header.port);
+        vdagent_virtio_port_destroy(vportp);
+        return -1;
+    }
+    return 0;
+}
+
+/* A helper for vdagent_virtio_port_do_read(), processes all complete chunks
+   in the read buffer (in large-read mode).
+   Return value: 1 on success, 0 if the port has been destroyed or reading
+   has been paused by a read callback */
+static int vdagent_virtio_port_parse_read_buf(
+    struct vdagent_virtio_port **vportp)
+{
+    struct vdagent_virtio_port *vport = *vportp;
+    const size_t header_size = sizeof(vport->chunk_header);
+
+    while (vport->read_end - vport->read_start >= header_size) {
+        if (vport->read_paused)
+            return 0;
+
+        memcpy(&vport->chunk_header, vport->read_buf + vport->read_start,
+               header_size);
+        if (vdagent_virtio_port_check_chunk_header(vportp))
+            return 0;
+
+        /* Wait for the rest of the chunk */
+        if (vport->read_end - vport->read_start - header_size <
+                vport->chunk_header.size)
+            break;
+
+        vport->read_start += header_size + vport->chunk_header.size;
+        vdagent_virtio_port_do_chunk(vportp, vport->read_buf +
+                                     vport->read_start -
+                                     vport->chunk_header.size);
+        if (!*vportp)
+            return 0;
+    }
+
+    if (vport->read_start == vport->read_end) {
+        vport->read_start = 0;
+        vport->read_end = 0;
+    }
+
+    return 1;
+}
+
+/* Return value: 1 if data was read and more may be available,
+   0 if the port would block, reading has been paused or the port has been
+   destroyed */
+static int vdagent_virtio_port_do_read(struct vdagent_virtio_port **vportp)
 {
     ssize_t n;
     size_t to_read;
     uint8_t *dest;
     struct vdagent_virtio_port *vport = *vportp;
-
-    if (vport->chunk_header_read < sizeof(vport->chunk_header)) {
+    struct vdagent_virtio_port_chunk_port_data *port;
+
+    if (vport->read_buf_size) {
+        /* First process any chunks left over from when reading got paused */
+        if (!vdagent_virtio_port_parse_read_buf(vportp))
+            return 0;
+        if (!vport->read_buf) {
+            vport->read_buf = malloc(vport->read_buf_size);
+            if (!vport->read_buf) {
+                syslog(LOG_ERR, "out of memory, disconnecting virtio");
+                vdagent_virtio_port_destroy(vportp);
+                return 0;
+            }
+        }
+        /* Move a partially received chunk to the start of the buffer */
+        if (vport->read_start) {
+            memmove(vport->read_buf, vport->read_buf + vport->read_start,
+                    vport->read_end - vport->read_start);
+            vport->read_end -= vport->read_start;
+            vport->read_start = 0;
+        }
+        to_read = vport->read_buf_size - vport->read_end;
+        dest = vport->read_buf + vport->read_end;
+    } else if (vport->chunk_header_read < sizeof(vport->chunk_header)) {
         to_read = sizeof(vport->chunk_header) - vport->chunk_header_read;
         dest = (uint8_t *)&vport->chunk_header + vport->chunk_header_read;
+    } else if (vport->chunk_direct) {
+        port = &vport->port_data[vport->chunk_header.port];
+        to_read = vport->chunk_header.size - vport->chunk_data_pos;
+        dest = port->message_data + port->message_data_pos +
+               vport->chunk_data_pos;
     } else {
         to_read = vport->chunk_header.size - vport->chunk_data_pos;
         dest = vport->chunk_data + vport->chunk_data_pos;
@@ -392,7 +714,9 @@ static void vdagent_virtio_port_do_read(struct vdagent_virtio_port **vportp)
     n = vport_read(vport, dest, to_read);
     if (n < 0) {
         if (errno == EINTR)
-            return;
+            return 1;
+        if (errno == EAGAIN)
+            return 0;
         syslog(LOG_ERR, "reading from vdagent virtio port: %m");
     }
     if (n == 0 && vport->opening) {
@@ -417,86 +741,167 @@ static void vdagent_virtio_port_do_read(struct vdagent_virtio_port **vportp)
            or written some data. If we hit this race we also sleep a bit here
            to avoid busy waiting until the above steps complete */
         usleep(10000);
-        return;
+        return 0;
     }
     if (n <= 0) {
         vdagent_virtio_port_destroy(vportp);
-        return;
+        return 0;
     }
     vport->opening = 0;
 
+    if (vport->read_buf_size) {
+        vport->read_end += n;
+        return vdagent_virtio_port_parse_read_buf(vportp);
+    }
+
     if (vport->chunk_header_read < sizeof(vport->chunk_header)) {
         vport->chunk_header_read += n;
         if (vport->chunk_header_read == sizeof(vport->chunk_header)) {
-            vport->chunk_header.size = GUINT32_FROM_LE(vport->chunk_header.size);
-            vport->chunk_header.port = GUINT32_FROM_LE(vport->chunk_header.port);
-            if (vport->chunk_header.size > VD_AGENT_MAX_DATA_SIZE) {
-                syslog(LOG_ERR, "chunk size %u too large",
-                       vport->chunk_header.size);
-                vdagent_virtio_port_destroy(vportp);
-                return;
-            }
-            if (vport->chunk_header.port >= VDP_END_PORT) {
-                syslog(LOG_ERR, "chunk port %u out of range",
-                       vport->chunk_header.port);
+            if (vdagent_virtio_port_check_chunk_header(vportp))
+                return 0;
+            /* If this is a continuation chunk of a message which is being
+               assembled, read it straight into the message buffer */
+            port = &vport->port_data[vport->chunk_header.port];
+            vport->chunk_direct = port->message_data != NULL;
+            if (vport->chunk_direct && vport->chunk_header.size >
+                    port->message_header.size - port->message_data_pos) {
+                syslog(LOG_ERR, "chunk larger than message, lost sync?");
                 vdagent_virtio_port_destroy(vportp);
-                return;
+                return 0;
             }
         }
     } else {
         vport->chunk_data_pos += n;
         if (vport->chunk_data_pos == vport->chunk_header.size) {
-            vdagent_virtio_port_do_chunk(vportp);
+            vdagent_virtio_port_do_chunk(vportp, vport->chunk_data);
             if (!*vportp)
-                return;
+                return 0;
             vport->chunk_header_read = 0;
             vport->chunk_data_pos = 0;
         }
     }
+
+    return 1;
 }
 
-static int vport_write(struct vdagent_virtio_port *vport, uint8_t *buf, int len)
+/* Load the next part of the data of a wbuf which is read from a fd,
+   Return value: 0 on success, -1 on error */
+static int vdagent_virtio_port_fill_buf(struct vdagent_virtio_port *vport,
+    struct vdagent_virtio_port_buf *wbuf)
 {
-    if (vport->is_uds) {
-        return send(vport->fd, buf, len, 0);
-    } else {
-        return write(vport->fd, buf, len);
+    size_t size = MIN(wbuf->fd_size - wbuf->fd_pos, VIRTIO_PORT_FD_CHUNK_SIZE);
+    ssize_t n;
+    uint8_t *buf;
+
+    /* The first part replaces the headers, make room for a full chunk */
+    if (wbuf->fd_pos == 0) {
+        buf = realloc(wbuf->buf, size);
+        if (!buf) {
+            syslog(LOG_ERR, "out of memory writing to vdagent virtio port");
+            return -1;
+        }
+        wbuf->buf = buf;
+    }
+
+    do {
+        n = pread(wbuf->fd, wbuf->buf, size, wbuf->fd_pos);
+    } while (n == -1 && errno == EINTR);
+    if (n <= 0) {
+        if (n == 0)
+            errno = EIO;
+        syslog(LOG_ERR, "reading data for vdagent virtio port: %m");
+        return -1;
     }
+
+    vport->write_buf_bytes -= wbuf->size;
+    vport->write_buf_bytes += n;
+    wbuf->fd_pos += n;
+    wbuf->pos = 0;
+    wbuf->size = n;
+    wbuf->write_pos = n;
+    return 0;
 }
 
-static void vdagent_virtio_port_do_write(struct vdagent_virtio_port **vportp)
+/* Return value: 1 if data was written and more is queued,
+   0 if the port would block, the write queue is empty or the port has been
+   destroyed */
+static int vdagent_virtio_port_do_write(struct vdagent_virtio_port **vportp)
 {
     ssize_t n;
-    size_t to_write;
+    size_t len;
+    struct iovec iov[IOV_MAX];
+    int iovcnt = 0, msgs = 0;
     struct vdagent_virtio_port *vport = *vportp;
 
     struct vdagent_virtio_port_buf* wbuf = vport->write_buf;
     if (!wbuf) {
         syslog(LOG_ERR, "do_write called on a port without a write buf ?!");
-        return;
+        return 0;
     }
 
     if (wbuf->write_pos != wbuf->size) {
         syslog(LOG_ERR, "do_write: buffer is incomplete!!");
-        return;
+        return 0;
+    }
+
+    /* Coalesce as many complete buffers as possible into a single writev(),
+       the last buffer may still be being filled by write_append. A buffer
+       with more data to come from its fd must be the last one. */
+    for (; wbuf && wbuf->write_pos == wbuf->size && iovcnt < IOV_MAX;
+         wbuf = wbuf->next) {
+        iov[iovcnt].iov_base = wbuf->buf + wbuf->pos;
+        iov[iovcnt].iov_len = wbuf->size - wbuf->pos;
+        iovcnt++;
+        if (wbuf->fd != -1 && wbuf->fd_pos < wbuf->fd_size)
+            break;
     }
 
-    to_write = wbuf->size - wbuf->pos;
-    n = vport_write(vport, wbuf->buf + wbuf->pos, to_write);
+    n = writev(vport->fd, iov, iovcnt);
     if (n < 0) {
         if (errno == EINTR)
-            return;
+            return 1;
+        if (errno == EAGAIN)
+            return 0;
         syslog(LOG_ERR, "writing to vdagent virtio port: %m");
         vdagent_virtio_port_destroy(vportp);
-        return;
+        return 0;
     }
     if (n > 0)
         vport->opening = 0;
 
-    wbuf->pos += n;
-    if (wbuf->pos == wbuf->size) {
+    /* Free all completely written buffers */
+    while ((wbuf = vport->write_buf) && n > 0) {
+        len = wbuf->size - wbuf->pos;
+        if ((size_t)n < len) {
+            wbuf->pos += n;
+            break;
+        }
+        n -= len;
+
+        if (wbuf->fd != -1 && wbuf->fd_pos < wbuf->fd_size) {
+            if (vdagent_virtio_port_fill_buf(vport, wbuf)) {
+                vdagent_virtio_port_destroy(vportp);
+                return 0;
+            }
+            break;
+        }
+
         vport->write_buf = wbuf->next;
+        if (!vport->write_buf)
+            vport->write_buf_tail = NULL;
+        vport->write_buf_depth--;
+        vport->write_buf_bytes -= wbuf->size;
+        if (vport->write_buf_bytes <= VIRTIO_PORT_WRITE_QUEUE_HIGH_WATER / 2)
+            vport->write_queue_full = 0;
+        if (wbuf->fd != -1)
+            close(wbuf->fd);
         free(wbuf->buf);
         free(wbuf);
+        msgs++;
     }
+
+    vport->write_calls++;
+    vport->write_msgs += msgs;
+
+    return vport->write_buf != NULL;
 }
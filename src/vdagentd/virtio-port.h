@@ -24,8 +24,8 @@
 
 #include <stdio.h>
 #include <stdint.h>
-#include <sys/select.h>
 #include <spice/vd_agent.h>
+#include "event-loop.h"
 
 struct vdagent_virtio_port;
 
@@ -50,6 +50,22 @@ typedef int (*vdagent_virtio_port_read_callback)(
 typedef void (*vdagent_virtio_port_disconnect_callback)(
     struct vdagent_virtio_port *conn);
 
+/* Callbacks with this type will be called with the data of the first chunk
+   of messages spanning multiple chunks, so that their data can be consumed
+   a chunk at a time, rather than being assembled in a message buffer first.
+   When the callback returns 1 the data of all further chunks of the message
+   is passed to it as soon as it has been read, offset being the position of
+   data within the message data, and the read callback does not get called
+   for the message. Return 0 to have the message assembled as usual, -1 to
+   close the port, like with the read callback. */
+typedef int (*vdagent_virtio_port_stream_callback)(
+    struct vdagent_virtio_port *vport,
+    int port_nr,
+    VDAgentMessage *message_header,
+    const uint8_t *data,
+    uint32_t offset,
+    uint32_t size);
+
 
 /* Create a vdagent virtio port object for port portname */
 struct vdagent_virtio_port *vdagent_virtio_port_create(const char *portname,
@@ -60,19 +76,49 @@ struct vdagent_virtio_port *vdagent_virtio_port_create(const char *portname,
 void vdagent_virtio_port_destroy(struct vdagent_virtio_port **vportp);
 
 
-/* Given a vdagent_virtio_port fill the fd_sets pointed to by readfds and
-   writefds for select() usage.
+/* Default size of the buffer used to read from the port */
+#define VIRTIO_PORT_DEFAULT_READ_BUF_SIZE (256 * 1024)
+
+/* Set the size of the buffer used to read from the port, this must be
+   called before any data has been read. As much data as the port has
+   available, up to size bytes, is read at once and all complete chunks in
+   it are processed in one go. Sizes smaller than a single chunk are rounded
+   up. A size of 0 disables buffering, then chunks are read one at a time,
+   with the data of messages spanning multiple chunks being read directly
+   into the message buffer.
+
+   Note the trade-off: chunks hold at most VD_AGENT_MAX_DATA_SIZE bytes,
+   each preceded by a chunk header, so the data of a large message is not
+   contiguous on the port. With buffering the data of messages spanning
+   multiple chunks is copied once, from the read buffer into the message
+   buffer, but a single read() covers many chunks. Without buffering that
+   copy is avoided at the cost of two read() calls per chunk. Messages
+   taken over by the stream callback are not assembled in either mode. */
+void vdagent_virtio_port_set_read_buffer_size(
+        struct vdagent_virtio_port *vport, size_t size);
+
+/* Set the callback which may take over messages spanning multiple chunks,
+   see vdagent_virtio_port_stream_callback, NULL disables this. */
+void vdagent_virtio_port_set_stream_callback(
+        struct vdagent_virtio_port *vport,
+        vdagent_virtio_port_stream_callback stream_callback);
+
+/* Register the port with the event loop. Events on the port are reported
+   to callback, which should pass them on to
+   vdagent_virtio_port_handle_events().
 
-   Return value: value of the highest fd + 1 */
-int vdagent_virtio_port_fill_fds(struct vdagent_virtio_port *vport,
-        fd_set *readfds, fd_set *writefds);
+   Return value: 0 on success, -1 on error */
+int vdagent_virtio_port_attach_event_loop(struct vdagent_virtio_port *vport,
+        struct vdagentd_event_loop *loop,
+        vdagentd_event_callback callback, void *opaque);
 
-/* Handle any events flagged by select for the given vdagent_virtio_port.
+/* Handle the events reported by the event loop for the given
+   vdagent_virtio_port.
    Note the port may be destroyed (when disconnected) by this call
    in this case the disconnect calllback will get called before the
-   destruction and the contents of connp will be made NULL */
-void vdagent_virtio_port_handle_fds(struct vdagent_virtio_port **vportp,
-        fd_set *readfds, fd_set *writefds);
+   destruction and the contents of vportp will be made NULL */
+void vdagent_virtio_port_handle_events(struct vdagent_virtio_port **vportp,
+        uint32_t events);
 
 
 /* Queue a message for delivery, either bit by bit, or all at once
@@ -85,6 +131,27 @@ int vdagent_virtio_port_write_start(
         uint32_t message_opaque,
         uint32_t data_size);
 
+/* Once this much data has been read from the fd passed to
+   vdagent_virtio_port_write_start_fd it gets written to the port before
+   reading more */
+#define VIRTIO_PORT_FD_CHUNK_SIZE (256 * 1024)
+
+/* Like vdagent_virtio_port_write_start, but the last fd_size bytes of the
+   message data are not appended, they are read from fd (starting at offset
+   0) bit by bit while the message is being written. This keeps the memory
+   used for sending large messages bounded. The port takes ownership of fd,
+   also on error.
+
+   Returns 0 on success -1 on error (only happens when malloc fails) */
+int vdagent_virtio_port_write_start_fd(
+        struct vdagent_virtio_port *vport,
+        uint32_t port_nr,
+        uint32_t message_type,
+        uint32_t message_opaque,
+        uint32_t data_size,
+        int fd,
+        uint32_t fd_size);
+
 int vdagent_virtio_port_write_append(
         struct vdagent_virtio_port *vport,
         const uint8_t *data,
@@ -98,6 +165,45 @@ int vdagent_virtio_port_write(
         const uint8_t *data,
         uint32_t data_size);
 
+/* Take ownership of the data of the message currently being passed to the
+   read callback, this may only be called from the read callback. The data
+   pointer passed to the callback stays valid until the callback returns.
+   Messages spanning multiple chunks are assembled in a buffer of their own,
+   which is handed over as is, the data of single chunk messages gets copied.
+
+   Return value: the data, to be freed with free(), or NULL if the message
+   has no data, it has already been claimed or when out of memory. */
+uint8_t *vdagent_virtio_port_steal_data(struct vdagent_virtio_port *vport);
+
+/* Once more than this many bytes are queued for writing
+   vdagent_virtio_port_write_queue_full() returns true, until the queue
+   has drained to half of it. */
+#define VIRTIO_PORT_WRITE_QUEUE_HIGH_WATER (4 * 1024 * 1024)
+
+/* Return value: true if the producer should stop queueing (bulk) messages,
+   this is advisory, writes are never refused because of it */
+int vdagent_virtio_port_write_queue_full(struct vdagent_virtio_port *vport);
+
+/* Get the number of messages and bytes currently queued for writing, and
+   the highest number of queued messages seen on this port.
+   Any of the pointers may be NULL. */
+void vdagent_virtio_port_get_write_queue_stats(
+        struct vdagent_virtio_port *vport,
+        unsigned int *depth, size_t *bytes, unsigned int *max_depth);
+
+/* Get the number of write syscalls done on this port, and the number of
+   messages they have completed. Any of the pointers may be NULL. */
+void vdagent_virtio_port_get_write_stats(struct vdagent_virtio_port *vport,
+        unsigned long *calls, unsigned long *msgs);
+
+/* Stop / resume reading from the port, this can be used to apply
+   backpressure to the client when a consumer of its messages is not keeping
+   up. This may be called from the read callback. Note the port is
+   edge-triggered, so after resuming vdagent_virtio_port_handle_events must be
+   called with EPOLLIN to read any data which arrived while paused. */
+void vdagent_virtio_port_set_read_paused(struct vdagent_virtio_port *vport,
+        int paused);
+
 void vdagent_virtio_port_flush(struct vdagent_virtio_port **vportp);
 void vdagent_virtio_port_reset(struct vdagent_virtio_port *vport, int port);
 